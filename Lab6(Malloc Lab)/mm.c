@@ -1,54 +1,124 @@
 /*
- * mm.c - The implementation is done with doubly linked explicit free list. 
- *        The global variable "*free_list" points to bp of Prologue block.
- * 
+ * mm.c - The implementation is done with segregated explicit free lists and a tree of large blocks.
+ *        Free blocks smaller than TREE_MIN are kept in LISTS doubly linked lists, one per size class.
+ *        Class i holds blocks of size [MINBLOCK << i, MINBLOCK << (i+1)).
+ *        The list heads are stored at the beginning of the heap of each arena; "seg_list" points to them.
+ *        Larger free blocks are kept in a splay tree ordered by size, then address,
+ *        whose left and right links take the place of predecessor and successor.
+ *
  * <Allocated block>                                         A = 1 : Allocated
  * --------------------------------------------              A = 0 : Free
- * |             Block size               | A |  Header      (The Width of Rentangle is WSIZE)
- * --------------------------------------------
+ * |             Block size           | P | A |  Header      P = 1 : Previous block allocated
+ * --------------------------------------------              (The Width of Rentangle is WSIZE)
  * |                                          |
- * |         Payload and Padding              | 
+ * |         Payload and Padding              |
  * |                                          |
  * |                                          |
  * --------------------------------------------
- * |             Block size               | A |  Footer
- * --------------------------------------------
- * 
+ * Allocated blocks have no footer: coalesce only needs the footer of a free
+ * previous block, and the P bit of the header tells whether it is free.
+ *
  * <Free block>
  * --------------------------------------------
- * |             Block size               | A |  Header
- * --------------------------------------------
- * |             Predecessor                  |
+ * |             Block size           | P | A |  Header
  * --------------------------------------------
+ * |             Predecessor                  |  (Offset of the block from the arena base,
+ * --------------------------------------------   in units of ALIGNMENT; 0 is NULL)
  * |              Successor                   |
  * --------------------------------------------
- * |                                          | 
+ * |                                          |
  * |                                          |
  * --------------------------------------------
  * |             Block size               | A |  Footer
  * --------------------------------------------
- *  
- * 
- * mm_init - Initialize the malloc package. Set Prologue block and Epilogue block and then Extend heap.
  *
- * mm_malloc - First find free block of which size is equal to or larger than malloc size with first fit algorithm.
+ * Headers, footers and links are 4-byte words on 32-bit and 64-bit hosts alike, so a free block is 16 bytes
+ * at least and an arena can hold 2^32 ALIGNMENT units. Blocks are smaller than 4GB: no arena is larger.
+ * Blocks are aligned to ALIGNMENT, 8 on 32-bit hosts and 16 on 64-bit hosts like malloc.
+ *
+ * <Heap>
+ * | seg_list heads (LISTS words) | Padding | Prologue hdr | Blocks ... | Epilogue hdr |
+ * The prologue is an allocated block of ALIGNMENT bytes; blocks after it are aligned.
+ *
+ * mm_init - Initialize the malloc package. Set list heads, Prologue block and Epilogue block and then Extend heap.
+ *
+ * mm_malloc - Find the best fit in the size class of malloc size.
+ *             If that class has no fit, take the best fit of the next nonempty class (every block there fits),
+ *             and then the smallest (lowest addressed) block of the tree which fits.
  *             If it can find that free block -> allocate
  *                                               if that free block is too large -> Split it
  *			   If it cannot find that free block -> extend heap and allocate
  *
  * mm_free - Set allocated/free flag(A) to zero.
- *           Insert the block to free list and coalesce. (The location of new free block is right after the prologue block.)
+ *           Coalesce with free neighbors and insert the block at the head of the list of its size class,
+ *           or into the tree.
  *
- * mm_realloc - mm_malloc for new size.
- *              Copy the memory from old ptr to new ptr.
- *				mm_free the old ptr.
+ * mm_realloc - Resize the block in place if it can:
+ *                  shrink -> Split off the tail and free it
+ *                  grow   -> Absorb the next block if it is free and large enough,
+ *                            or extend the heap first if the block is the last one
+ *              Otherwise mm_malloc for new size, copy the memory from old ptr to new ptr and mm_free the old ptr.
+ *
+ * <Threads>
+ * There is one arena per CPU (at most MAX_ARENAS). An arena is a heap of its own, laid out as above,
+ * with its own lists and its own lock, so threads on different arenas never wait for each other.
+ *   - Arena 0 grows with mem_sbrk. The others grow inside an address range of ARENA_RESERVE bytes
+ *     reserved with mmap when the arena is first used; the pages are only backed once touched.
+ *   - A thread is given an arena round robin on its first mm_malloc and keeps it.
+ *     If its arena is out of memory, the other arenas are tried.
+ *   - A block always goes back to the arena it came from, whichever thread frees it.
+ *     The arena is found from the address: one of the mmap ranges, else arena 0.
+ * Every thread also has a cache of small free blocks (tcache), one LIFO bin per block size
+ * up to TCACHE_MAX. Blocks in a bin stay marked allocated in their arena, so nobody else touches them.
+ *   - mm_malloc pops a block of the exact size from the bin without locking.
+ *     An empty bin is refilled with TCACHE_REFILL blocks under one acquisition of the arena lock.
+ *   - mm_free pushes a small block to its bin without locking.
+ *     A full bin first gives half of its blocks back to their arenas.
+ *   - When a thread exits, its cached blocks go back to their arenas.
+ * mm_init starts a new heap generation: the mmap arenas are unmapped and
+ * caches filled from an older heap are dropped.
+ *
+ * <Small blocks>
+ * Requests of up to SLAB_MAX bytes do not go to the arenas. They get a slot in a slab page:
+ * a SLAB_PAGE-aligned page of one slot size (a multiple of ALIGNMENT), with a page header
+ * and no header per slot. The free slots of a page are linked through their first word.
+ *   - All slab pages are in one address range reserved with mmap by mm_init,
+ *     so mm_free knows a slot by its address and finds its page by rounding down.
+ *   - Each slot size (class) has a list of its pages with free slots and a lock.
+ *     A page whose slots are all free goes back to a pool of empty pages for any class.
+ *   - Like small blocks, slots are cached per thread: mm_malloc takes SLAB_REFILL slots
+ *     under one acquisition of the class lock, and mm_free keeps up to TCACHE_COUNT.
+ * If the slab range is used up, small requests are served by the arenas.
+ *
+ * <Huge blocks>
+ * Requests of mmap_threshold bytes or more (MMAP_THRESHOLD, or MM_MMAP_THRESHOLD in the
+ * environment at mm_init) get a mapping of their own, so they neither grow nor fragment
+ * the arenas and their memory goes back to the system as soon as they are freed.
+ * The payload starts ALIGNMENT bytes into the mapping, after the length of the mapping
+ * and a header with the MMAPPED bit. mm_free unmaps them and mm_realloc resizes them with mremap.
+ *
+ * <Releasing memory>
+ * When mm_free leaves a free block of trim_threshold bytes or more (TRIM_THRESHOLD, or
+ * MM_TRIM_THRESHOLD in the environment at mm_init), its memory goes back to the system:
+ *   - At the end of an arena, top_pad bytes (TOP_PAD, or MM_TOP_PAD) of the block are kept
+ *     for the next requests, and only a block larger than trim_threshold + top_pad is trimmed.
+ *     In an mmap arena the rest is cut off: the epilogue and the break move back to the end
+ *     of the pad, and the pages after it are released with madvise(MADV_DONTNEED).
+ *     (Arena 0 can not shrink, since mem_sbrk only grows, so its pages are only released.)
+ *   - Otherwise the whole pages inside the block are released, except those holding its header,
+ *     links and footer. The pages are zero when used again.
+ * Pages of a free neighbor which was already that large were released before and are skipped.
  */
 
+#define _GNU_SOURCE				/* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -69,37 +139,58 @@ team_t team = {
 
 /* ***** MACROs ***** */
 
-/* single word (4) or double word (8) alignment */
+/* double word (8) alignment, or 16 bytes on 64-bit hosts */
+#if defined(__LP64__) || defined(_WIN64)
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(size_t)(ALIGNMENT-1))
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
 /* Basic constants and macros */
 #define WSIZE 4			    /* Word and header/footer size (bytes) */
 #define DSIZE 8			    /* Double word size (bytes) */
 #define CHUNKSIZE (1<<12)	/* Extend heap by this amount (bytes)  */
+#define MINBLOCK (2*DSIZE)	/* Header, predecessor, successor and footer of a free block */
+#define LISTS 6				/* Number of size classes */
+#define TREE_MIN (MINBLOCK << LISTS)	/* Free blocks this large are kept in the tree */
+#define HEADS_SIZE ALIGN(LISTS*WSIZE)	/* List heads at the beginning of an arena */
 
-/* Compute maximum b/w x and y */
+/* Compute maximum and minimum b/w x and y */
 #define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+
+/* Size of the block for a payload of size bytes: the header, then alignment reqs. */
+#define ADJUST_SIZE(size) MAX(MINBLOCK, ALIGN((size) + WSIZE))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc) ((size) | (alloc))
+#define PREV_ALLOC 0x2		/* Header bit: the previous block is allocated */
+#define MMAPPED 0x4			/* Header bit: the block is a mapping of its own */
 
-/* Read and write a word at address p */
-#define GET(p) (*(unsigned int *)(p))
-#define PUT(p, val) (*(unsigned int *)(p) = (val))
+/* Read and write a word at address p.
+   Relaxed atomics (plain loads and stores on x86): the owner of a block reads its size
+   without the arena lock while the arena may update the P bit of the same header */
+#define GET(p) __atomic_load_n((unsigned int *)(p), __ATOMIC_RELAXED)
+#define PUT(p, val) __atomic_store_n((unsigned int *)(p), (val), __ATOMIC_RELAXED)
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p) (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+
+/* Set or clear the PREV_ALLOC bit in the header of bp */
+#define SET_PREV_ALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) & ~PREV_ALLOC)
 
-/* Compute address of its header and footer */
+/* Compute address of its header and footer (free blocks only) */
 #define HDRP(bp) ((char *)(bp) - WSIZE)
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Compute address of next and previous blocks */
+/* Compute address of next and previous blocks (previous only if it is free) */
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
@@ -107,116 +198,312 @@ team_t team = {
 #define PRED_PTR(bp) ((char *)(bp))
 #define SUCC_PTR(bp) ((char *)(bp) + WSIZE)
 
-/* Compute address of predecessor and successor  */
-#define PRED(bp) (*(char **)(bp))
-#define SUCC(bp) (*(char **)(SUCC_PTR(bp)))
+/* Convert between a block and its link word in arena a: the offset from the base in units of ALIGNMENT */
+#define TO_OFF(a, bp) ((bp) == NULL ? 0 : (unsigned int)(((char *)(bp) - (a)->base) / ALIGNMENT))
+#define TO_PTR(a, off) ((off) == 0 ? NULL : (a)->base + (size_t)(off) * ALIGNMENT)
+
+/* Compute address of predecessor and successor, and set them */
+#define PRED(a, bp) TO_PTR(a, GET(PRED_PTR(bp)))
+#define SUCC(a, bp) TO_PTR(a, GET(SUCC_PTR(bp)))
+#define SET_PRED(a, bp, ptr) PUT(PRED_PTR(bp), TO_OFF(a, ptr))
+#define SET_SUCC(a, bp, ptr) PUT(SUCC_PTR(bp), TO_OFF(a, ptr))
+
+/* Children of a block in the tree */
+#define LEFT(a, bp) PRED(a, bp)
+#define RIGHT(a, bp) SUCC(a, bp)
+#define SET_LEFT(a, bp, ptr) SET_PRED(a, bp, ptr)
+#define SET_RIGHT(a, bp, ptr) SET_SUCC(a, bp, ptr)
+
+/* Whether the key (size, addr) comes before/after block bp in the tree */
+#define KEY_LT(size, addr, bp) ((size) < GET_SIZE(HDRP(bp)) || ((size) == GET_SIZE(HDRP(bp)) && (char *)(addr) < (char *)(bp)))
+#define KEY_GT(size, addr, bp) ((size) > GET_SIZE(HDRP(bp)) || ((size) == GET_SIZE(HDRP(bp)) && (char *)(addr) > (char *)(bp)))
+
+/* Next block in a thread's cache or next free slot: a pointer in the first payload word */
+#define LINK(p) (*(char **)(p))
+
+/* Store a pointer at address p */
+#define SET_PTR(p, ptr) (*(char **)(p) = (char *)(ptr))
+
+/* Head of the free list of size class i in arena a, and set it */
+#define SEG_HEAD(a, i) TO_PTR(a, GET((a)->seg_list + (i)*WSIZE))
+#define SET_SEG_HEAD(a, i, ptr) PUT((a)->seg_list + (i)*WSIZE, TO_OFF(a, ptr))
+
+/* Arenas */
+#define MAX_ARENAS 16
+#if ALIGNMENT == 16
+#define ARENA_RESERVE ((size_t)1<<32)	/* Address range reserved for each mmap arena, and size limit of any arena (bytes) */
+#else
+#define ARENA_RESERVE ((size_t)64<<20)
+#endif
+
+/* Slab pages of small blocks */
+#define SLAB_MAX 64				/* Largest request served from slabs (bytes) */
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+#define SLAB_CLASS(size) (((size) - 1) / ALIGNMENT)	/* Class of a request of size bytes */
+#define SLAB_PAGE 4096
+#define SLAB_HDR ALIGN(sizeof(slab_page_t))		/* Offset of the first slot */
+#define SLAB_RESERVE (64<<20)	/* Address range reserved for slab pages (bytes) */
+#define SLAB_REFILL 8			/* Slots taken from a class when the thread's cache is empty */
+
+/* Whether p is a slot, and the page of slot p */
+#define IS_SLOT(p) ((char *)(p) >= slab_lo && (char *)(p) < slab_end)
+#define PAGE_OF(p) ((slab_page_t *)((unsigned long)(p) & ~(unsigned long)(SLAB_PAGE - 1)))
+
+/* Huge blocks */
+#define MMAP_THRESHOLD (128<<10)	/* Default of mmap_threshold (bytes) */
+#define IS_MMAPPED(bp) (GET(HDRP(bp)) & MMAPPED)
+#define MMAP_LEN(bp) (*(size_t *)((char *)(bp) - ALIGNMENT))	/* Length of the mapping of bp */
+#define PAGE_ALIGN(size) (((size) + pagesize - 1) & ~(pagesize - 1))
+
+/* Releasing memory of free blocks */
+#define TRIM_THRESHOLD (128<<10)	/* Default of trim_threshold (bytes) */
+#define TOP_PAD (128<<10)			/* Default of top_pad (bytes) */
+
+/* Per-thread cache of small blocks */
+#define TCACHE_MAX (64*DSIZE)	/* Largest block size cached */
+#define TCACHE_BINS ((TCACHE_MAX - MINBLOCK) / ALIGNMENT + 1)
+#define TCACHE_COUNT 16			/* Blocks kept per bin at most */
+#define TCACHE_REFILL 4			/* Blocks taken from the heap when a bin is empty */
+#define TCACHE_BIN(size) (((size) - MINBLOCK) / ALIGNMENT)
 
 /* ***** End of MACRO ***** */
 
 
+/* ***** Types ***** */
+typedef struct {
+	pthread_mutex_t lock;
+	char *base;			/* Start of the arena's heap; links are offsets from it */
+	char *seg_list;		/* List heads, at the beginning of the arena's heap */
+	char *tree;			/* Root of the tree of large free blocks */
+	char *lo, *brk, *end;	/* Reserved range and break of an mmap arena */
+} arena_t;
+
+typedef struct slab_page {
+	struct slab_page *prev, *next;	/* Pages of the class with free slots, or empty pages */
+	char *free;					/* Free slots, linked through their first word */
+	unsigned size;				/* Slot size */
+	unsigned nfree;
+} slab_page_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	slab_page_t *partial;		/* Pages with free slots */
+} slab_class_t;
+
+typedef struct {
+	unsigned gen;				/* heap_gen of the heap the blocks come from */
+	arena_t *arena;				/* Arena of the thread, NULL until its first mm_malloc */
+	char *bin[TCACHE_BINS];		/* LIFO lists linked through the first payload word */
+	int count[TCACHE_BINS];
+	char *slot[SLAB_CLASSES];	/* Cached slots, linked the same way */
+	int nslot[SLAB_CLASSES];
+} tcache_t;
+
+
 /* ***** Global Variables ***** */
-void *free_list;
+static arena_t arenas[MAX_ARENAS];	/* arenas[0] is the mem_sbrk heap */
+static int narenas = 1;				/* Arenas to use, one per CPU */
+static int nmade = 1;				/* Arenas set up so far */
+static unsigned next_arena = 0;		/* Round robin of threads over arenas */
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;	/* Setting up arenas */
+static slab_class_t slabs[SLAB_CLASSES];
+static char *slab_lo, *slab_brk, *slab_end;	/* Reserved range of slab pages, used up to slab_brk */
+static slab_page_t *slab_empty;		/* Pages with all slots free */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;	/* slab_brk and slab_empty */
+static unsigned heap_gen = 0;		/* Incremented by mm_init */
+static size_t mmap_threshold = MMAP_THRESHOLD;	/* Requests this large are mapped on their own */
+static size_t trim_threshold = TRIM_THRESHOLD;	/* Free blocks this large give their pages back */
+static size_t top_pad = TOP_PAD;				/* Free bytes kept at the end of an arena */
+static size_t pagesize = 4096;
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;	/* Its destructor empties the cache of an exiting thread */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
 
 
 /* ***** Internal Functions ***** */
-static void *extend_heap(size_t words);
-static void *coalesce(void *bp);
-static void *find_fit(size_t asize);
-static void place(void *bp, size_t asize);
-static void insert_node(void *ptr, size_t size);
-static void delete_node(void *ptr);
+static void *extend_heap(arena_t *a, size_t words);
+static void *coalesce(arena_t *a, void *bp);
+static void *find_fit(arena_t *a, size_t asize);
+static void place(arena_t *a, void *bp, size_t asize);
+static int list_index(size_t size);
+static void insert_node(arena_t *a, void *ptr, size_t size);
+static void delete_node(arena_t *a, void *ptr);
+static char *splay(arena_t *a, char *t, size_t size, char *addr);
+static void tree_insert(arena_t *a, char *bp);
+static void tree_delete(arena_t *a, char *bp);
+static int tree_check(arena_t *a, char *bp, char **prev);
+static void *heap_alloc(arena_t *a, size_t asize);
+static void heap_free(arena_t *a, void *ptr);
+static void heap_release(arena_t *a, char *bp, char *start, char *end);
+static int realloc_in_place(arena_t *a, void *bp, size_t asize);
+static int arena_init(arena_t *a);
+static arena_t *arena_new(int i);
+static void *arena_sbrk(arena_t *a, size_t incr);
+static arena_t *arena_of(void *ptr);
+static arena_t *thread_arena(void);
+static void tcache_sync(void);
+static void *tcache_get(size_t asize);
+static int tcache_put(void *ptr, size_t size);
+static void tcache_refill(arena_t *a, size_t asize);
+static void tcache_flush(size_t size, int n);
+static void *slab_get(int c);
+static void slab_free(void *ptr);
+static void slab_refill(int c);
+static void slab_flush(int c, int n);
+static void slab_put(slab_class_t *sc, void *ptr);
+static slab_page_t *slab_page_new(int c);
+static void *mmap_alloc(size_t size);
+static void *mmap_resize(void *ptr, size_t size);
+static size_t payload_size(void *ptr);
+static void init_once_fn(void);
+static void tcache_release(void *arg);
 int mm_check(void);
 
-/* 
+/*
  * mm_init - Initialize the malloc package.
- *           Set Prologue block and Epilogue block and then Extend heap.
+ *           Drop the arenas of the previous heap and set up arena 0 on the mem_sbrk heap;
+ *           the other arenas are set up when threads first use them.
  */
 int mm_init(void)
 {
-	/* Create the initial empty heap */
-	if ((free_list = mem_sbrk(8*WSIZE)) == (void *)-1)
-		return -1;
-	PUT(free_list, 0);							   /* Alignment padding */
-	PUT(free_list + (1*WSIZE), PACK(2*DSIZE, 1));  /* Prologue header */
-	free_list += (2*WSIZE);						   /* Set free_list to bp of Prologue block */
-	PUT(free_list + (2*WSIZE), PACK(2*DSIZE, 1));  /* Prologue footer */
-	PUT(free_list + (3*WSIZE), PACK(0, 0));		   /* Epilogue header */
-
-	/* Set predecessor & successor of prologue and epilogue block */
-	PUT(PRED_PTR(free_list), NULL);
-	PUT(SUCC_PTR(free_list), NEXT_BLKP(free_list));
-	PUT(PRED_PTR(NEXT_BLKP(free_list)), free_list);
-	PUT(SUCC_PTR(NEXT_BLKP(free_list)), NULL);
+	long cpus;
+	char *env;
+	int i;
 
-	/* Extend the empty heap with a free block of CHUNKSIZE bytes */
-	if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
-		return -1;
-	return 0;
+	pthread_once(&init_once, init_once_fn);
+	heap_gen++;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	mmap_threshold = MMAP_THRESHOLD;
+	if ((env = getenv("MM_MMAP_THRESHOLD")) != NULL)
+		mmap_threshold = strtoul(env, NULL, 0);
+	if (mmap_threshold > ARENA_RESERVE)		/* Larger requests do not fit in an arena */
+		mmap_threshold = ARENA_RESERVE;
+	trim_threshold = TRIM_THRESHOLD;
+	if ((env = getenv("MM_TRIM_THRESHOLD")) != NULL)
+		trim_threshold = strtoul(env, NULL, 0);
+	top_pad = TOP_PAD;
+	if ((env = getenv("MM_TOP_PAD")) != NULL)
+		top_pad = strtoul(env, NULL, 0);
+	if (top_pad > ARENA_RESERVE)
+		top_pad = ARENA_RESERVE;
+
+	for (i = 1; i < nmade; i++)
+		munmap(arenas[i].lo, ARENA_RESERVE);
+	nmade = 1;
+	next_arena = 0;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	narenas = (cpus < 1) ? 1 : (cpus > MAX_ARENAS) ? MAX_ARENAS : cpus;
+
+	/* Without a slab range, small requests go to the arenas */
+	if (slab_lo != NULL)
+		munmap(slab_lo, SLAB_RESERVE);
+	slab_lo = mmap(NULL, SLAB_RESERVE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (slab_lo == MAP_FAILED)
+		slab_lo = NULL;
+	slab_brk = slab_lo;
+	slab_end = slab_lo ? slab_lo + SLAB_RESERVE : NULL;
+	slab_empty = NULL;
+	for (i = 0; i < SLAB_CLASSES; i++)
+		slabs[i].partial = NULL;
+
+	return arena_init(&arenas[0]);
 }
 
-/* 
+/*
  * mm_malloc - Allocate a block by incrementing the brk pointer.
  *             Always allocate a block whose size is a multiple of the alignment.
- *             
- *             First find free block of which size is equal to or larger than malloc size with first fit algorithm.
- *             If it can find that free block -> allocate
- *                                               if that free block is too large -> Split it
- *			   If it cannot find that free block -> extend heap and allocate
+ *
+ *             Small blocks come from the thread's cache if it has one of that size.
+ *             Otherwise the heap is locked and searched (heap_alloc).
  */
 void *mm_malloc(size_t size)
 {
 	size_t asize;		/* Adjusted block size */
-	size_t extendsize;  /* Amount to extend heap if no fit */
+	arena_t *a;
 	char *bp;
+	int i;
 
 	/* Ignore spurious requests */
 	if (size == 0)
 		return NULL;
 
+	/* Map huge blocks on their own; if that fails, try the arenas unless it is larger than an arena */
+	if (size >= mmap_threshold && (bp = mmap_alloc(size)) != NULL)
+		return bp;
+	if (size > ARENA_RESERVE)
+		return NULL;
+
 	/* Adjust block size to include overhead and alignment reqs. */
-	if (size <= DSIZE)
-		asize = 2*DSIZE;
-	else
-		asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
+	asize = ADJUST_SIZE(size);
 
-	/* Search the free list for a fit */
-	if ((bp = find_fit(asize)) != NULL){
-		place(bp, asize);
-		
+	tcache_sync();
+	if (size <= SLAB_MAX && (bp = slab_get(SLAB_CLASS(size))) != NULL)
+		return bp;
+	if (asize <= TCACHE_MAX && (bp = tcache_get(asize)) != NULL)
 		return bp;
-	}
 
-	/* No fit found. Get more memory and place the block */
-	extendsize = MAX(asize, CHUNKSIZE);
-	if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
-		return NULL;
-	place(bp, asize);
+	a = thread_arena();
+	pthread_mutex_lock(&a->lock);
+	bp = heap_alloc(a, asize);
+	if (bp != NULL && asize <= TCACHE_MAX)
+		tcache_refill(a, asize);
+	pthread_mutex_unlock(&a->lock);
+
+	/* The arena of the thread is full; try the others */
+	for (i = 0; bp == NULL && i < __atomic_load_n(&nmade, __ATOMIC_ACQUIRE); i++){
+		if (&arenas[i] == a)
+			continue;
+		pthread_mutex_lock(&arenas[i].lock);
+		bp = heap_alloc(&arenas[i], asize);
+		pthread_mutex_unlock(&arenas[i].lock);
+	}
 	return bp;
 }
 
 /*
  * mm_free - Freeing a block does nothing.
  *
- *           Set allocated/free flag(A) to zero.
- *           Insert the block to free list and coalesce. (The location of new free block is right after the prologue block.)
+ *           Small blocks go to the thread's cache; a full bin first gives half of
+ *           its blocks back. Other blocks are freed in the arena they belong to,
+ *           under its lock (heap_free).
  */
 void mm_free(void *ptr)
 {
-	size_t size = GET_SIZE(HDRP(ptr));
+	size_t size;
+	arena_t *a;
 
-	/* Set allocated/free flag A to zero */
-	PUT(HDRP(ptr), PACK(size, 0));
-	PUT(FTRP(ptr), PACK(size, 0));
+	if (ptr == NULL)
+		return;
+	if (IS_SLOT(ptr)){
+		slab_free(ptr);
+		return;
+	}
+	if (IS_MMAPPED(ptr)){
+		munmap((char *)ptr - ALIGNMENT, MMAP_LEN(ptr));
+		return;
+	}
+	size = GET_SIZE(HDRP(ptr));
+	if (size <= TCACHE_MAX && tcache.gen == heap_gen){
+		if (!tcache_put(ptr, size)){
+			tcache_flush(size, TCACHE_COUNT/2);
+			tcache_put(ptr, size);
+		}
+		return;
+	}
 
-	insert_node(ptr, size);
-	coalesce(ptr);
+	a = arena_of(ptr);
+	pthread_mutex_lock(&a->lock);
+	heap_free(a, ptr);
+	pthread_mutex_unlock(&a->lock);
 }
 
 
 /*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
- * 
- *              mm_malloc for new size.
+ * mm_realloc - Resize the block in its arena if it can (realloc_in_place).
+ *              A slot is kept if the new size fits in it, and a huge block is remapped.
+ *
+ *              Otherwise mm_malloc for new size.
  *              Copy the memory from old ptr to new ptr.
  *				mm_free the old ptr.
  */
@@ -224,18 +511,49 @@ void *mm_realloc(void *ptr, size_t size)
 {
 	void *newptr;
 	void *oldptr = ptr;
-	size_t copySize;
-	size_t oldsize = GET_SIZE(HDRP(ptr));
+	size_t oldsize;
+	arena_t *a;
+	int done;
 
 	if (ptr == NULL)
 		return mm_malloc(size);
 	if (size == 0){
 		mm_free(ptr);
-		return;
+		return NULL;
+	}
+
+	if (IS_SLOT(ptr)){
+		if (size <= PAGE_OF(ptr)->size)
+			return ptr;
+	}
+	else if (IS_MMAPPED(ptr)){
+		if (size >= mmap_threshold)
+			return mmap_resize(ptr, size);
+	}
+	else if (size < mmap_threshold){
+		a = arena_of(ptr);
+		pthread_mutex_lock(&a->lock);
+		done = realloc_in_place(a, ptr, ADJUST_SIZE(size));
+		pthread_mutex_unlock(&a->lock);
+		if (done)
+			return ptr;
 	}
 
-	if ((newptr = mm_malloc(size)) == NULL)
+	/* Not from the thread's cache, whose refills put more cached blocks right behind
+	   the new block, which would stop it from growing in place the next time */
+	newptr = NULL;
+	if (size < mmap_threshold){
+		tcache_sync();
+		a = thread_arena();
+		pthread_mutex_lock(&a->lock);
+		newptr = heap_alloc(a, ADJUST_SIZE(size));
+		pthread_mutex_unlock(&a->lock);
+	}
+	if (newptr == NULL && (newptr = mm_malloc(size)) == NULL)
 		return NULL;
+
+	/* Only the payload is copied; the bytes after it belong to the next block */
+	oldsize = payload_size(ptr);
 	memcpy(newptr, oldptr, oldsize < size ? oldsize : size);
 	mm_free(oldptr);
 	return newptr;
@@ -243,177 +561,942 @@ void *mm_realloc(void *ptr, size_t size)
 
 
 /*
- * extend_heap - Extend the size of heap and change the address of epilogue block
+ * heap_alloc - Allocate a block of asize bytes from arena a. Caller holds its lock.
+ *
+ *              Find the best fit in the segregated free lists.
+ *              If it can find that free block -> allocate
+ *                                                if that free block is too large -> Split it
+ *			    If it cannot find that free block -> extend heap and allocate
  */
-static void *extend_heap(size_t words)
+static void *heap_alloc(arena_t *a, size_t asize)
 {
+	size_t extendsize;  /* Amount to extend heap if no fit */
 	char *bp;
-	size_t size;
-	
-	/* Allocate an even number of words to maintain alignment */
-	size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-	if ((long)(bp = mem_sbrk(size)) == -1)
+
+	/* Search the free lists for a fit */
+	if ((bp = find_fit(a, asize)) != NULL){
+		place(a, bp, asize);
+
+		return bp;
+	}
+
+	/* No fit found. Get more memory and place the block */
+	extendsize = MAX(asize, CHUNKSIZE);
+	if ((bp = extend_heap(a, extendsize/WSIZE)) == NULL)
+		return NULL;
+	place(a, bp, asize);
+	return bp;
+}
+
+/*
+ * heap_free - Return a block to its arena a. Caller holds its lock.
+ *
+ *             Set allocated/free flag(A) to zero.
+ *             Coalesce with free neighbors and insert the block to the list of its size class.
+ *             If the joined block is large, release its memory (heap_release).
+ */
+static void heap_free(arena_t *a, void *ptr)
+{
+	size_t size = GET_SIZE(HDRP(ptr));
+	char *start = HDRP(ptr), *end = HDRP(ptr) + size;	/* Memory which may still be in use */
+	char *prev, *next = NEXT_BLKP(ptr), *bp;
+
+	/* A free neighbor smaller than trim_threshold still has all its pages,
+	   a larger one only those of its header, links and footer */
+	if (!GET_PREV_ALLOC(HDRP(ptr))){
+		prev = PREV_BLKP(ptr);
+		start = (GET_SIZE(HDRP(prev)) < trim_threshold) ? HDRP(prev) : FTRP(prev);
+	}
+	if (!GET_ALLOC(HDRP(next)))
+		end = (GET_SIZE(HDRP(next)) < trim_threshold) ? HDRP(NEXT_BLKP(next)) : next + 2*WSIZE;
+
+	/* Set allocated/free flag A to zero, and P of the next block */
+	PUT(HDRP(ptr), PACK(size, 0) | GET_PREV_ALLOC(HDRP(ptr)));
+	PUT(FTRP(ptr), PACK(size, 0));
+	CLR_PREV_ALLOC(NEXT_BLKP(ptr));
+
+	bp = coalesce(a, ptr);
+	if (GET_SIZE(HDRP(bp)) >= trim_threshold)
+		heap_release(a, bp, start, end);
+}
+
+/*
+ * heap_release - Give the pages of [start, end) in the free block bp of arena a back to the system.
+ *                Caller holds the lock of a.
+ *                The last block of an arena keeps top_pad bytes, and all its pages after them are
+ *                released. In an mmap arena the block is also cut off the heap after the pad.
+ */
+static void heap_release(arena_t *a, char *bp, char *start, char *end)
+{
+	size_t size = GET_SIZE(HDRP(bp)), keep = ALIGN(top_pad);
+	char *lo, *hi;
+
+	if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0){
+		if (size < trim_threshold + keep || size <= keep)
+			return;
+		if (a == &arenas[0]){
+			lo = (char *)PAGE_ALIGN((size_t)bp + MAX(keep, 2*WSIZE));
+			hi = (char *)((size_t)FTRP(bp) & ~(pagesize - 1));
+		}
+		else {
+			/* The pad stays a free block (or the block becomes the epilogue without one),
+			   and the arena ends after it */
+			delete_node(a, bp);
+			if (keep >= MINBLOCK){
+				PUT(HDRP(bp), PACK(keep, 0) | PREV_ALLOC);
+				PUT(FTRP(bp), PACK(keep, 0));
+				insert_node(a, bp, keep);
+				PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+			}
+			else {
+				keep = 0;
+				PUT(HDRP(bp), PACK(0, 1) | PREV_ALLOC);
+			}
+			lo = (char *)PAGE_ALIGN((size_t)bp + keep);
+			hi = a->brk;
+			a->brk = bp + keep;
+		}
+	}
+	else {
+		/* Whole pages of [start, end), but not those of the header, the links and the footer */
+		lo = (char *)MAX((size_t)start & ~(pagesize - 1), PAGE_ALIGN((size_t)bp + 2*WSIZE));
+		hi = (char *)MIN(PAGE_ALIGN((size_t)end), (size_t)FTRP(bp) & ~(pagesize - 1));
+	}
+	if (hi > lo)
+		madvise(lo, hi - lo, MADV_DONTNEED);
+}
+
+
+/*
+ * arena_init - Set list heads, Prologue block and Epilogue block of arena a and then Extend heap.
+ */
+static int arena_init(arena_t *a)
+{
+	char *heap;
+	int i;
+
+	/* Create the initial empty heap */
+	if ((heap = arena_sbrk(a, HEADS_SIZE + 2*ALIGNMENT)) == (void *)-1)
+		return -1;
+	a->base = heap;
+	a->seg_list = heap;
+	for (i = 0; i < LISTS; i++)
+		SET_SEG_HEAD(a, i, NULL);
+	a->tree = NULL;
+	heap += HEADS_SIZE + ALIGNMENT;		/* The prologue block, after its header and padding */
+
+	PUT(HDRP(heap), PACK(ALIGNMENT, 1) | PREV_ALLOC);				/* Prologue header */
+	PUT(HDRP(NEXT_BLKP(heap)), PACK(0, 1) | PREV_ALLOC);			/* Epilogue header */
+
+	/* Extend the empty heap with a free block of CHUNKSIZE bytes */
+	if (extend_heap(a, CHUNKSIZE/WSIZE) == NULL)
+		return -1;
+	return 0;
+}
+
+/*
+ * arena_new - Reserve the address range of arena i and set it up. Caller holds arenas_lock.
+ *             Returns NULL if there is no memory for it.
+ */
+static arena_t *arena_new(int i)
+{
+	arena_t *a = &arenas[i];
+	char *p;
+
+	p = mmap(NULL, ARENA_RESERVE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	a->lo = a->brk = p;
+	a->end = p + ARENA_RESERVE;
+	if (arena_init(a) < 0){
+		munmap(p, ARENA_RESERVE);
 		return NULL;
+	}
+	return a;
+}
+
+/*
+ * arena_sbrk - Extend the heap of arena a by incr bytes like mem_sbrk.
+ *              Returns the old break, or (void *)-1 if the arena would grow beyond ARENA_RESERVE bytes.
+ */
+static void *arena_sbrk(arena_t *a, size_t incr)
+{
+	char *old = a->brk;
+
+	if (a == &arenas[0]){
+		if (incr > INT_MAX || mem_heapsize() + incr > ARENA_RESERVE)
+			return (void *)-1;
+		return mem_sbrk(incr);
+	}
+	if (incr > (size_t)(a->end - a->brk))
+		return (void *)-1;
+	a->brk += incr;
+	return old;
+}
+
+/*
+ * arena_of - Arena which the block ptr belongs to
+ */
+static arena_t *arena_of(void *ptr)
+{
+	int i, n = __atomic_load_n(&nmade, __ATOMIC_ACQUIRE);
+
+	for (i = 1; i < n; i++){
+		if ((char *)ptr >= arenas[i].lo && (char *)ptr < arenas[i].end)
+			return &arenas[i];
+	}
+	return &arenas[0];
+}
+
+/*
+ * thread_arena - Arena of the calling thread. On its first call the thread
+ *                is given the next arena round robin, which is set up if needed.
+ *                Falls back to arena 0 if an arena can not be set up.
+ */
+static arena_t *thread_arena(void)
+{
+	int i;
+
+	if (tcache.arena != NULL)
+		return tcache.arena;
+
+	i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % narenas;
+	pthread_mutex_lock(&arenas_lock);
+	/* arena_of() reads nmade without the lock; the new arena is set up before it is counted */
+	while (nmade <= i && arena_new(nmade) != NULL)
+		__atomic_store_n(&nmade, nmade + 1, __ATOMIC_RELEASE);
+	tcache.arena = &arenas[(i < nmade) ? i : 0];
+	pthread_mutex_unlock(&arenas_lock);
+	return tcache.arena;
+}
 
-	bp -= 2*WSIZE;
+
+/*
+ * realloc_in_place - Resize the allocated block bp of arena a to asize bytes without moving it.
+ *                    Caller holds the lock of a.
+ *                    Growing absorbs the next block if it is free; if the block (with that free
+ *                    block) is the last one before the epilogue, the heap is extended behind it.
+ *                    A tail of MINBLOCK bytes or more is split off and freed.
+ *                    Returns 0 if the block can not grow in place.
+ */
+static int realloc_in_place(arena_t *a, void *bp, size_t asize)
+{
+	size_t csize = GET_SIZE(HDRP(bp));
+	size_t avail = csize;	/* Size of bp with the free block after it */
+	char *next = NEXT_BLKP(bp);
+
+	if (asize > csize){
+		if (!GET_ALLOC(HDRP(next)))
+			avail += GET_SIZE(HDRP(next));
+		if (avail < asize && GET_SIZE(HDRP((char *)bp + avail)) == 0){
+			/* The new free block is coalesced with next, if that was free, and starts at next */
+			if (extend_heap(a, MAX(asize - avail, CHUNKSIZE)/WSIZE) == NULL)
+				return 0;
+			avail = csize + GET_SIZE(HDRP(next));
+		}
+		if (avail < asize)
+			return 0;
+		if (avail > csize)
+			delete_node(a, next);
+		csize = avail;
+		PUT(HDRP(bp), PACK(csize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+		SET_PREV_ALLOC(NEXT_BLKP(bp));
+	}
+
+	/* Split off the tail */
+	if ((csize - asize) >= MINBLOCK){
+		PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+		next = NEXT_BLKP(bp);
+		PUT(HDRP(next), PACK(csize-asize, 0) | PREV_ALLOC);
+		PUT(FTRP(next), PACK(csize-asize, 0));
+		CLR_PREV_ALLOC(NEXT_BLKP(next));
+		coalesce(a, next);
+	}
+	return 1;
+}
+
+
+/*
+ * extend_heap - Extend the size of heap and move the epilogue header to the new end
+ */
+static void *extend_heap(arena_t *a, size_t words)
+{
+	char *bp;
+	size_t size;
+
+	/* Allocate a multiple of ALIGNMENT to maintain alignment */
+	size = ALIGN(words * WSIZE);
+	if ((long)(bp = arena_sbrk(a, size)) == -1)
+		return NULL;
 
 	/* Initialize free block header/footer and the epilogue header */
-	PUT(HDRP(bp), PACK(size, 0));	      /* Free block header */
+	PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)));	/* Free block header (replaces old epilogue) */
 	PUT(FTRP(bp), PACK(size, 0));	      /* Free block footer */
-	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
+	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header, after a free block */
 
-	/* Change the address of epilogue block */
-	PUT(SUCC_PTR(bp), NEXT_BLKP(bp));
-	PUT(PRED_PTR(NEXT_BLKP(bp)), bp);
-	PUT(SUCC_PTR(NEXT_BLKP(bp)), NULL);
-	
 	/* Coalesce if the previous block was free */
-	return coalesce(bp);
+	return coalesce(a, bp);
 }
 
 /*
- * coalesce - Join with prev/next block, if they are free
+ * coalesce - Join with prev/next block, if they are free.
+ *            The joined block is inserted to the list of its size class.
+ *            No two free blocks are adjacent, so the block before the joined one is allocated (P = 1).
  */
-static void *coalesce(void *bp)
+static void *coalesce(arena_t *a, void *bp)
 {
-	size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+	size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
 	size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
 	size_t size = GET_SIZE(HDRP(bp));
 
 	if (prev_alloc && next_alloc){  /* Case 1 - both prev and next are allocated */
-		return bp;
 	}
 	else if (prev_alloc){   		/* Case 2 - prev is allocated / next is free */
 		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-		delete_node(NEXT_BLKP(bp));
-		PUT(HDRP(bp), PACK(size, 0));
+		delete_node(a, NEXT_BLKP(bp));
+		PUT(HDRP(bp), PACK(size, 0) | PREV_ALLOC);
 		PUT(FTRP(bp), PACK(size, 0));
 	}
 	else if (next_alloc){   		/* Case 3 - prev is free / next is allocated */
 		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-		delete_node(bp);
+		delete_node(a, PREV_BLKP(bp));
 		PUT(FTRP(bp), PACK(size, 0));
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | PREV_ALLOC);
 		bp = PREV_BLKP(bp);
 	}
 	else {							/* Case 4 - both prev and next is free */
 		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
-		delete_node(bp);
-		delete_node(NEXT_BLKP(bp));
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+		delete_node(a, PREV_BLKP(bp));
+		delete_node(a, NEXT_BLKP(bp));
+		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | PREV_ALLOC);
 		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
 		bp = PREV_BLKP(bp);
 	}
+	insert_node(a, bp, size);
 	return bp;
 }
 
 /*
- * find_fit - Find a free block of which size is equal to or larger than malloc size
- *            Using first find algorithm(searching list from the beginning)
+ * find_fit - Find the smallest free block of which size is equal to or larger than malloc size.
+ *            The class of asize is searched first; in any larger class every block fits,
+ *            so the first nonempty one gives the best fit. Then the tree: the leftmost
+ *            block not smaller than asize, of the smallest size and the lowest address.
  */
-static void *find_fit(size_t asize)
+static void *find_fit(arena_t *a, size_t asize)
 {
-	/* First-fit search */
-	void *bp;
-	
-	for (bp = free_list; GET_SIZE(HDRP(bp)) > 0; bp = SUCC(bp)){
-		if ((asize <= GET_SIZE(HDRP(bp))) && (bp != free_list)){
-			return bp;
+	void *bp, *best;
+	int i;
+
+	for (i = list_index(asize); asize < TREE_MIN && i < LISTS; i++){
+		best = NULL;
+		for (bp = SEG_HEAD(a, i); bp != NULL; bp = SUCC(a, bp)){
+			if (GET_SIZE(HDRP(bp)) < asize)
+				continue;
+			if (best == NULL || GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(best)))
+				best = bp;
+			if (GET_SIZE(HDRP(bp)) == asize)
+				break;
 		}
+		if (best != NULL)
+			return best;
 	}
-	return NULL; /* No fit */
+
+	best = NULL;
+	for (bp = a->tree; bp != NULL; ){
+		if (GET_SIZE(HDRP(bp)) >= asize){
+			best = bp;
+			bp = LEFT(a, bp);
+		}
+		else
+			bp = RIGHT(a, bp);
+	}
+	return best; /* NULL if no fit */
 }
 
 /*
  * place - Allocate the asize on the heap where the bp is pointing
  *		   Split the block if the block is bigger enough than asize
  */
-static void place(void *bp, size_t asize)
+static void place(arena_t *a, void *bp, size_t asize)
 {
 	size_t csize = GET_SIZE(HDRP(bp));
-	void *prev;
-	void *next;
 
-	delete_node(bp);
+	delete_node(a, bp);
 
 	/* Split the block */
-	if ((csize - asize) >= (2*DSIZE)){ 
-		PUT(HDRP(bp), PACK(asize, 1));
-		PUT(FTRP(bp), PACK(asize, 1));
-		prev = PRED(bp);
-		next = SUCC(bp);
+	if ((csize - asize) >= MINBLOCK){
+		PUT(HDRP(bp), PACK(asize, 1) | PREV_ALLOC);
 		bp = NEXT_BLKP(bp);
-		PUT(HDRP(bp), PACK(csize-asize, 0));
+		PUT(HDRP(bp), PACK(csize-asize, 0) | PREV_ALLOC);
 		PUT(FTRP(bp), PACK(csize-asize, 0));
-		PUT(PRED_PTR(bp), prev);
-		PUT(SUCC_PTR(bp), next);
-		insert_node(bp, csize-asize);
+		insert_node(a, bp, csize-asize);
 	}
 	/* Not split the block */
 	else{
-		PUT(HDRP(bp), PACK(csize, 1));
-		PUT(FTRP(bp), PACK(csize, 1));
+		PUT(HDRP(bp), PACK(csize, 1) | PREV_ALLOC);
+		SET_PREV_ALLOC(NEXT_BLKP(bp));
 	}
 }
 
 
-/* 
- * insert_node - Insert the block into free list
- *               Place new free block right after the prologue block
+/*
+ * list_index - Size class of a block of size bytes
  */
-static void insert_node(void *ptr, size_t size)
+static int list_index(size_t size)
 {
-	void *insert = free_list;
-	void *insert_next = SUCC(insert);
+	int i = 0;
+
+	while (i < LISTS - 1 && size >= ((size_t)MINBLOCK << (i + 1)))
+		i++;
+	return i;
+}
 
-	PUT(SUCC_PTR(insert), ptr);
-	PUT(PRED_PTR(insert_next), ptr);
-	PUT(PRED_PTR(ptr), insert);
-	PUT(SUCC_PTR(ptr), insert_next);
+/*
+ * insert_node - Insert the block into the free list of its size class, or the tree if it is large
+ *               Place new free block at the head of the list
+ */
+static void insert_node(arena_t *a, void *ptr, size_t size)
+{
+	int i = list_index(size);
+	void *insert_next = SEG_HEAD(a, i);
+
+	if (size >= TREE_MIN){
+		tree_insert(a, ptr);
+		return;
+	}
+
+	SET_PRED(a, ptr, NULL);
+	SET_SUCC(a, ptr, insert_next);
+	if (insert_next != NULL)
+		SET_PRED(a, insert_next, ptr);
+	SET_SEG_HEAD(a, i, ptr);
 
 	return;
 }
 
 /*
- * delete_node - Delete the block pointed by ptr from free list
+ * delete_node - Delete the block pointed by ptr from the free list of its size class, or the tree
+ *               Its header must still hold the size it was inserted with.
  */
-static void delete_node(void *ptr)
+static void delete_node(arena_t *a, void *ptr)
 {
-	void *prev = PRED(ptr);
-	void *next = SUCC(ptr);
-	
-	PUT(SUCC_PTR(prev), next);
-	PUT(PRED_PTR(next), prev);
+	void *prev = PRED(a, ptr);
+	void *next = SUCC(a, ptr);
+
+	if (GET_SIZE(HDRP(ptr)) >= TREE_MIN){
+		tree_delete(a, ptr);
+		return;
+	}
+
+	if (prev != NULL)
+		SET_SUCC(a, prev, next);
+	else
+		SET_SEG_HEAD(a, list_index(GET_SIZE(HDRP(ptr))), next);
+	if (next != NULL)
+		SET_PRED(a, next, prev);
 
 	return;
 }
 
 /*
- * mm_check - Print all blocks in free list
- *			  Check whether all blocks in free list is free or not
+ * splay - Top-down splay of the tree t of arena a at key (size, addr).
+ *         Returns the new root: the block with that key if there is one, else the
+ *         last block on the search path, just before or after the key.
  */
-int mm_check(void)
+static char *splay(arena_t *a, char *t, size_t size, char *addr)
 {
-	void *bp;
-	
-	printf("Print bp of blocks in free list\n");
-	for (bp = free_list; GET_SIZE(HDRP(bp)) > 0; bp = SUCC(bp)){
-		if (bp == free_list)
-			printf("Prologue block %p size %x alloc %d\n", bp, GET_SIZE(bp), GET_ALLOC(bp));
-		else if (SUCC(bp) == NULL)
-			printf("Epilogue block %p size %x alloc %d\n", bp, GET_SIZE(bp), GET_ALLOC(bp));
+	unsigned int left = 0, right = 0;	/* Blocks before / after the key, as two trees */
+	char *lmax = (char *)&left;		/* Link where the next block before the key goes (right child of the largest) */
+	char *rmin = (char *)&right;	/* Link where the next block after the key goes (left child of the smallest) */
+	char *y;
+
+	if (t == NULL)
+		return NULL;
+	for (;;){
+		if (KEY_LT(size, addr, t)){
+			if (LEFT(a, t) == NULL)
+				break;
+			if (KEY_LT(size, addr, LEFT(a, t))){	/* Rotate right */
+				y = LEFT(a, t);
+				SET_LEFT(a, t, RIGHT(a, y));
+				SET_RIGHT(a, y, t);
+				t = y;
+				if (LEFT(a, t) == NULL)
+					break;
+			}
+			PUT(rmin, TO_OFF(a, t));			/* Link right */
+			rmin = PRED_PTR(t);
+			t = LEFT(a, t);
+		}
+		else if (KEY_GT(size, addr, t)){
+			if (RIGHT(a, t) == NULL)
+				break;
+			if (KEY_GT(size, addr, RIGHT(a, t))){	/* Rotate left */
+				y = RIGHT(a, t);
+				SET_RIGHT(a, t, LEFT(a, y));
+				SET_LEFT(a, y, t);
+				t = y;
+				if (RIGHT(a, t) == NULL)
+					break;
+			}
+			PUT(lmax, TO_OFF(a, t));			/* Link left */
+			lmax = SUCC_PTR(t);
+			t = RIGHT(a, t);
+		}
 		else
-			printf("free block %p size %x alloc %d\n", bp, GET_SIZE(bp), GET_ALLOC(bp));
+			break;
+	}
+	/* Assemble */
+	PUT(lmax, GET(PRED_PTR(t)));
+	PUT(rmin, GET(SUCC_PTR(t)));
+	PUT(PRED_PTR(t), left);
+	PUT(SUCC_PTR(t), right);
+	return t;
+}
+
+/*
+ * tree_insert - Insert the free block bp into the tree of arena a, as the new root
+ */
+static void tree_insert(arena_t *a, char *bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	char *t;
+
+	if ((t = splay(a, a->tree, size, bp)) == NULL){
+		SET_LEFT(a, bp, NULL);
+		SET_RIGHT(a, bp, NULL);
+	}
+	else if (KEY_LT(size, bp, t)){
+		SET_LEFT(a, bp, LEFT(a, t));
+		SET_RIGHT(a, bp, t);
+		SET_LEFT(a, t, NULL);
+	}
+	else {
+		SET_RIGHT(a, bp, RIGHT(a, t));
+		SET_LEFT(a, bp, t);
+		SET_RIGHT(a, t, NULL);
+	}
+	a->tree = bp;
+}
+
+/*
+ * tree_delete - Delete the block bp from the tree of arena a.
+ *               After splaying bp to the root, the largest block of its left
+ *               subtree is splayed to the top of it and takes the right subtree.
+ */
+static void tree_delete(arena_t *a, char *bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	char *t = splay(a, a->tree, size, bp), *x;
+
+	if (LEFT(a, t) == NULL)
+		a->tree = RIGHT(a, t);
+	else {
+		x = splay(a, LEFT(a, t), size, bp);
+		SET_RIGHT(a, x, RIGHT(a, t));
+		a->tree = x;
+	}
+}
+
+/*
+ * tcache_sync - Start an empty cache, without an arena, if the thread has none for the current heap.
+ *               Blocks cached before the last mm_init are dropped.
+ */
+static void tcache_sync(void)
+{
+	if (tcache.gen != heap_gen){
+		memset(&tcache, 0, sizeof(tcache));
+		tcache.gen = heap_gen;
+		pthread_setspecific(tcache_key, &tcache);
+	}
+}
+
+/*
+ * tcache_get - Pop a cached block of asize bytes. Returns NULL if the bin is empty.
+ */
+static void *tcache_get(size_t asize)
+{
+	int b = TCACHE_BIN(asize);
+	char *bp;
+
+	if ((bp = tcache.bin[b]) == NULL)
+		return NULL;
+	tcache.bin[b] = LINK(bp);
+	tcache.count[b]--;
+	return bp;
+}
+
+/*
+ * tcache_put - Push a block of size bytes to its bin.
+ *              Returns 0 if the bin is full or no bin holds that size.
+ */
+static int tcache_put(void *ptr, size_t size)
+{
+	int b = TCACHE_BIN(size);
+
+	if (size > TCACHE_MAX || tcache.gen != heap_gen || tcache.count[b] >= TCACHE_COUNT)
+		return 0;
+	SET_PTR(ptr, tcache.bin[b]);
+	tcache.bin[b] = ptr;
+	tcache.count[b]++;
+	return 1;
+}
+
+/*
+ * tcache_refill - Fill the empty bin of asize with blocks from arena a. Caller holds its lock.
+ */
+static void tcache_refill(arena_t *a, size_t asize)
+{
+	char *bp;
+	int n;
+
+	for (n = 1; n < TCACHE_REFILL; n++){
+		if ((bp = heap_alloc(a, asize)) == NULL)
+			return;
+		/* place() may leave a block larger than asize, which belongs to another bin */
+		if (!tcache_put(bp, GET_SIZE(HDRP(bp)))){
+			heap_free(a, bp);
+			return;
+		}
 	}
+}
+
+/*
+ * tcache_flush - Return n blocks of the bin of size to their arenas.
+ *                Consecutive blocks of one arena are freed under one acquisition of its lock.
+ */
+static void tcache_flush(size_t size, int n)
+{
+	int b = TCACHE_BIN(size);
+	arena_t *a = NULL, *owner;
+	char *bp;
 
-	for (bp = free_list; GET_SIZE(HDRP(bp)) > 0; bp = SUCC(bp)){
-		if ((GET_ALLOC(HDRP(bp)) != 0) && ((bp != free_list) || (GET_SIZE(HDRP(bp)) == 0))){
-			printf("%p : not free block in free list\n", bp);
-			return 1;
+	while (n-- > 0 && (bp = tcache.bin[b]) != NULL){
+		tcache.bin[b] = LINK(bp);
+		tcache.count[b]--;
+		if ((owner = arena_of(bp)) != a){
+			if (a != NULL)
+				pthread_mutex_unlock(&a->lock);
+			a = owner;
+			pthread_mutex_lock(&a->lock);
 		}
+		heap_free(a, bp);
 	}
-	
-	return 0;
+	if (a != NULL)
+		pthread_mutex_unlock(&a->lock);
 }
 
+/*
+ * slab_get - Pop a slot of class c from the thread's cache, which is refilled if it is empty.
+ *            Returns NULL if the slab range is used up.
+ */
+static void *slab_get(int c)
+{
+	char *p;
+
+	if (tcache.slot[c] == NULL)
+		slab_refill(c);
+	if ((p = tcache.slot[c]) == NULL)
+		return NULL;
+	tcache.slot[c] = LINK(p);
+	tcache.nslot[c]--;
+	return p;
+}
 
+/*
+ * slab_free - Push the slot ptr to the thread's cache; a full cache first gives half of its slots back.
+ *             A thread without a cache for the current heap gives the slot back at once.
+ */
+static void slab_free(void *ptr)
+{
+	int c = SLAB_CLASS(PAGE_OF(ptr)->size);
+
+	if (tcache.gen != heap_gen){
+		pthread_mutex_lock(&slabs[c].lock);
+		slab_put(&slabs[c], ptr);
+		pthread_mutex_unlock(&slabs[c].lock);
+		return;
+	}
+	if (tcache.nslot[c] >= TCACHE_COUNT)
+		slab_flush(c, TCACHE_COUNT/2);
+	SET_PTR(ptr, tcache.slot[c]);
+	tcache.slot[c] = ptr;
+	tcache.nslot[c]++;
+}
+
+/*
+ * slab_refill - Move up to SLAB_REFILL free slots of class c to the thread's cache,
+ *               taking new pages if the class has no free slots
+ */
+static void slab_refill(int c)
+{
+	slab_class_t *sc = &slabs[c];
+	slab_page_t *pg;
+	char *p;
+	int n;
+
+	pthread_mutex_lock(&sc->lock);
+	for (n = 0; n < SLAB_REFILL; n++){
+		if ((pg = sc->partial) == NULL && (pg = slab_page_new(c)) == NULL)
+			break;
+		p = pg->free;
+		pg->free = LINK(p);
+		if (--pg->nfree == 0){
+			sc->partial = pg->next;
+			if (pg->next != NULL)
+				pg->next->prev = NULL;
+		}
+		SET_PTR(p, tcache.slot[c]);
+		tcache.slot[c] = p;
+		tcache.nslot[c]++;
+	}
+	pthread_mutex_unlock(&sc->lock);
+}
+
+/*
+ * slab_flush - Give n slots of class c in the thread's cache back to their pages
+ */
+static void slab_flush(int c, int n)
+{
+	char *p;
+
+	pthread_mutex_lock(&slabs[c].lock);
+	while (n-- > 0 && (p = tcache.slot[c]) != NULL){
+		tcache.slot[c] = LINK(p);
+		tcache.nslot[c]--;
+		slab_put(&slabs[c], p);
+	}
+	pthread_mutex_unlock(&slabs[c].lock);
+}
+
+/*
+ * slab_put - Give the slot ptr back to its page. Caller holds the lock of its class sc.
+ *            A page which had no free slot joins the list of the class, and
+ *            a page whose slots are all free leaves it for the empty pages.
+ */
+static void slab_put(slab_class_t *sc, void *ptr)
+{
+	slab_page_t *pg = PAGE_OF(ptr);
+
+	SET_PTR(ptr, pg->free);
+	pg->free = ptr;
+	if (pg->nfree++ == 0){
+		pg->prev = NULL;
+		pg->next = sc->partial;
+		if (sc->partial != NULL)
+			sc->partial->prev = pg;
+		sc->partial = pg;
+	}
+	if (pg->nfree == (SLAB_PAGE - SLAB_HDR) / pg->size){
+		if (pg->prev != NULL)
+			pg->prev->next = pg->next;
+		else
+			sc->partial = pg->next;
+		if (pg->next != NULL)
+			pg->next->prev = pg->prev;
+		pthread_mutex_lock(&slab_lock);
+		pg->next = slab_empty;
+		slab_empty = pg;
+		pthread_mutex_unlock(&slab_lock);
+	}
+}
+
+/*
+ * slab_page_new - Make an empty page, or a new one at slab_brk, a page of class c
+ *                 and put it on the list of the class. Caller holds the lock of the class.
+ *                 Returns NULL if the slab range is used up.
+ */
+static slab_page_t *slab_page_new(int c)
+{
+	slab_page_t *pg;
+	unsigned size = (c + 1) * ALIGNMENT, i;
+	char *p;
+
+	pthread_mutex_lock(&slab_lock);
+	if ((pg = slab_empty) != NULL)
+		slab_empty = pg->next;
+	else if (slab_brk != slab_end){
+		pg = (slab_page_t *)slab_brk;
+		slab_brk += SLAB_PAGE;
+	}
+	pthread_mutex_unlock(&slab_lock);
+	if (pg == NULL)
+		return NULL;
+
+	pg->size = size;
+	pg->nfree = (SLAB_PAGE - SLAB_HDR) / size;
+	pg->free = NULL;
+	for (i = pg->nfree; i-- > 0; ){
+		p = (char *)pg + SLAB_HDR + i*size;
+		SET_PTR(p, pg->free);
+		pg->free = p;
+	}
+	pg->prev = NULL;
+	pg->next = slabs[c].partial;
+	if (pg->next != NULL)
+		pg->next->prev = pg;
+	slabs[c].partial = pg;
+	return pg;
+}
+
+/*
+ * mmap_alloc - Map a huge block of size bytes on its own. Returns NULL if mmap fails.
+ */
+static void *mmap_alloc(size_t size)
+{
+	size_t len = PAGE_ALIGN(size + ALIGNMENT);
+	char *bp;
+
+	if (len < size)		/* Overflow */
+		return NULL;
+	bp = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bp == MAP_FAILED)
+		return NULL;
+	bp += ALIGNMENT;
+	MMAP_LEN(bp) = len;
+	PUT(HDRP(bp), PACK(0, 1) | MMAPPED);
+	return bp;
+}
+
+/*
+ * mmap_resize - Resize the mapping of the huge block ptr to hold size bytes; it may move.
+ *               Returns NULL, leaving ptr as it is, if mremap fails.
+ */
+static void *mmap_resize(void *ptr, size_t size)
+{
+	size_t len = PAGE_ALIGN(size + ALIGNMENT);
+	char *base;
+
+	if (len < size)
+		return NULL;
+	if (len == MMAP_LEN(ptr))
+		return ptr;
+	base = mremap((char *)ptr - ALIGNMENT, MMAP_LEN(ptr), len, MREMAP_MAYMOVE);
+	if (base == MAP_FAILED)
+		return NULL;
+	MMAP_LEN(base + ALIGNMENT) = len;
+	return base + ALIGNMENT;
+}
+
+/*
+ * payload_size - Usable size of the block ptr: a slot, a huge block or a block of an arena
+ */
+static size_t payload_size(void *ptr)
+{
+	if (IS_SLOT(ptr))
+		return PAGE_OF(ptr)->size;
+	if (IS_MMAPPED(ptr))
+		return MMAP_LEN(ptr) - ALIGNMENT;
+	return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+static void init_once_fn(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_ARENAS; i++)
+		pthread_mutex_init(&arenas[i].lock, NULL);
+	for (i = 0; i < SLAB_CLASSES; i++)
+		pthread_mutex_init(&slabs[i].lock, NULL);
+	pthread_key_create(&tcache_key, tcache_release);
+}
+
+/*
+ * tcache_release - Return all blocks cached by an exiting thread to their arenas
+ */
+static void tcache_release(void *arg)
+{
+	int b;
+
+	if (tcache.gen == heap_gen){
+		for (b = 0; b < TCACHE_BINS; b++)
+			tcache_flush(MINBLOCK + b*ALIGNMENT, TCACHE_COUNT);
+		for (b = 0; b < SLAB_CLASSES; b++)
+			slab_flush(b, TCACHE_COUNT);
+	}
+}
+
+/*
+ * mm_check - Print all blocks in free lists
+ *			  Check whether all blocks in free lists are free and in the right size class, in every arena,
+ *			  whether the tree holds large free blocks in order,
+ *			  and whether the slab pages listed in each class have free slots of that class
+ */
+int mm_check(void)
+{
+	slab_page_t *pg;
+	arena_t *a;
+	char *prev;
+	void *bp;
+	int i, n, err = 0;
+
+	for (n = 0; n < __atomic_load_n(&nmade, __ATOMIC_ACQUIRE) && !err; n++){
+		a = &arenas[n];
+		pthread_mutex_lock(&a->lock);
+		printf("Print bp of blocks in free lists of arena %d\n", n);
+		for (i = 0; i < LISTS; i++){
+			for (bp = SEG_HEAD(a, i); bp != NULL; bp = SUCC(a, bp))
+				printf("class %d free block %p size %x alloc %d\n", i, bp, GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)));
+		}
+		prev = NULL;
+		if (tree_check(a, a->tree, &prev))
+			err = 1;
+
+		for (i = 0; i < LISTS && !err; i++){
+			for (bp = SEG_HEAD(a, i); bp != NULL && !err; bp = SUCC(a, bp)){
+				if (GET_ALLOC(HDRP(bp)) != 0){
+					printf("%p : not free block in free list\n", bp);
+					err = 1;
+				}
+				else if (list_index(GET_SIZE(HDRP(bp))) != i){
+					printf("%p : block in free list of wrong size class\n", bp);
+					err = 1;
+				}
+				else if (GET(FTRP(bp)) != PACK(GET_SIZE(HDRP(bp)), 0) || GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)))){
+					printf("%p : free block without footer or with P set in next block\n", bp);
+					err = 1;
+				}
+				else if (arena_of(bp) != a){
+					printf("%p : block in free list of another arena\n", bp);
+					err = 1;
+				}
+			}
+		}
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	for (n = 0; n < SLAB_CLASSES && !err; n++){
+		pthread_mutex_lock(&slabs[n].lock);
+		for (pg = slabs[n].partial; pg != NULL && !err; pg = pg->next){
+			if (pg->size != (n + 1) * ALIGNMENT || pg->nfree == 0 || pg->free == NULL){
+				printf("%p : slab page of wrong class or without free slots\n", (void *)pg);
+				err = 1;
+			}
+		}
+		pthread_mutex_unlock(&slabs[n].lock);
+	}
+	return err;
+}
+
+/*
+ * tree_check - Print the blocks of the tree bp of arena a in order, and check that they are free,
+ *              large and each one after the block prev before it. Returns 1 on error.
+ */
+static int tree_check(arena_t *a, char *bp, char **prev)
+{
+	if (bp == NULL)
+		return 0;
+	if (tree_check(a, LEFT(a, bp), prev))
+		return 1;
+	printf("tree free block %p size %x alloc %d\n", bp, GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)));
+	if (GET_ALLOC(HDRP(bp)) != 0 || GET_SIZE(HDRP(bp)) < TREE_MIN){
+		printf("%p : not free or small block in tree\n", bp);
+		return 1;
+	}
+	if (*prev != NULL && !KEY_GT(GET_SIZE(HDRP(bp)), bp, *prev)){
+		printf("%p : block out of order in tree\n", bp);
+		return 1;
+	}
+	*prev = bp;
+	return tree_check(a, RIGHT(a, bp), prev);
+}
@@ -0,0 +1,125 @@
+/*
+ * mmbench.c - Scalability benchmark of mm.c over 1..N threads.
+ *
+ *     Every thread keeps SLOTS live blocks and does ops random operations:
+ *     a random slot is freed if it holds a block, otherwise a block of a
+ *     random size (mostly small, sometimes up to 4KB) is allocated and its
+ *     first and last bytes written. Each thread count is run on a fresh heap
+ *     (mem_reset_brk, mm_init), and the throughput is printed along with the
+ *     speedup over one thread. Perfect scaling gives a speedup of N at N
+ *     threads, up to the number of CPUs.
+ *
+ *     Build: gcc -O2 -pthread -o mmbench mmbench.c mm.c memlib.c
+ *     Usage: mmbench [max threads (default: CPUs)] [ops per thread (default: 1000000)]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define SLOTS 1000			/* Live blocks per thread at most */
+
+typedef struct {
+	long ops;
+	unsigned seed;
+	int failed;
+} worker_t;
+
+static void *worker(void *arg);
+static double now(void);
+
+
+int main(int argc, char **argv)
+{
+	int nthreads, t, i;
+	long ops;
+	double start, secs, base = 0;
+	pthread_t tid[256];
+	worker_t w[256];
+
+	nthreads = (argc > 1) ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	ops = (argc > 2) ? atol(argv[2]) : 1000000;
+	if (nthreads < 1 || nthreads > 256 || ops < 1){
+		fprintf(stderr, "usage: %s [max threads (1..256)] [ops per thread]\n", argv[0]);
+		return 1;
+	}
+
+	mem_init();
+	printf("%8s %10s %12s %8s\n", "threads", "secs", "Mops/s", "speedup");
+	for (t = 1; t <= nthreads; t++){
+		mem_reset_brk();
+		if (mm_init() < 0){
+			fprintf(stderr, "mm_init failed\n");
+			return 1;
+		}
+
+		start = now();
+		for (i = 0; i < t; i++){
+			w[i].ops = ops;
+			w[i].seed = i + 1;
+			w[i].failed = 0;
+			pthread_create(&tid[i], NULL, worker, &w[i]);
+		}
+		for (i = 0; i < t; i++)
+			pthread_join(tid[i], NULL);
+		secs = now() - start;
+
+		for (i = 0; i < t; i++){
+			if (w[i].failed){
+				fprintf(stderr, "out of memory at %d threads\n", t);
+				return 1;
+			}
+		}
+		if (t == 1)
+			base = ops / secs;
+		printf("%8d %10.3f %12.2f %8.2f\n", t, secs, t * ops / secs / 1e6, t * ops / secs / base);
+	}
+	return 0;
+}
+
+
+/*
+ * worker - Allocate and free random blocks, then free what is left
+ */
+static void *worker(void *arg)
+{
+	worker_t *w = arg;
+	char *slot[SLOTS];
+	size_t size;
+	long n;
+	int i, r;
+
+	memset(slot, 0, sizeof(slot));
+	for (n = 0; n < w->ops; n++){
+		r = rand_r(&w->seed);
+		i = r % SLOTS;
+		if (slot[i] != NULL){
+			mm_free(slot[i]);
+			slot[i] = NULL;
+			continue;
+		}
+		/* 7 of 8 blocks are 1..256 bytes, the rest up to 4KB */
+		size = ((r >> 12) & 7) ? 1 + (r >> 16) % 256 : 1 + (r >> 16) % 4096;
+		if ((slot[i] = mm_malloc(size)) == NULL){
+			w->failed = 1;
+			break;
+		}
+		slot[i][0] = slot[i][size - 1] = (char)n;
+	}
+	for (i = 0; i < SLOTS; i++)
+		mm_free(slot[i]);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,126 @@
+/*
+ * affinity.c - Place connection threads on the CPU or NUMA node of the NIC queue.
+ *
+ *     SO_INCOMING_CPU tells which CPU processed the packets of an accepted
+ *     connection, i.e. the CPU serving its NIC receive queue. The thread of
+ *     the connection is created with its affinity set to that CPU, or to the
+ *     CPUs of its NUMA node, so the socket, the thread and the data it
+ *     touches stay on one socket of the machine.
+ *
+ *     Memory follows the default first-touch policy: the thread stack, the
+ *     per-request buffers and the cache objects a thread inserts are all
+ *     first written by the pinned thread and so come from its local node.
+ *
+ *     The CPU to node map is read from /sys/devices/system/node at startup.
+ */
+/* CPU sets are GNU extensions; csapp.h is not included since it clashes with _GNU_SOURCE */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "affinity.h"
+
+#define MAX_NODES 64
+
+static int place_mode = AFFINITY_NONE;
+static int ncpus = 0;
+static cpu_set_t node_cpus[MAX_NODES];
+static int *cpu_node = NULL;        /* Node of each CPU */
+
+static void read_nodes(void);
+
+
+/*
+ * affinity_init - Read the machine topology for mode.
+ *                 Returns -1 if connections can not be placed here.
+ */
+int affinity_init(int mode)
+{
+    int cpu, probe;
+    socklen_t len = sizeof(probe);
+
+    /* Kernels without SO_INCOMING_CPU reject it on any socket */
+    if ((probe = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (getsockopt(probe, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0){
+        close(probe);
+        return -1;
+    }
+    close(probe);
+
+    if ((ncpus = sysconf(_SC_NPROCESSORS_CONF)) <= 0 || ncpus > CPU_SETSIZE)
+        return -1;
+    if (mode == AFFINITY_NODE)
+        read_nodes();
+    place_mode = mode;
+    return 0;
+}
+
+
+/*
+ * affinity_attr - Set the CPU affinity in attr for the thread which serves connfd.
+ *                 Returns 0 if it was set, -1 if the thread may run anywhere.
+ */
+int affinity_attr(pthread_attr_t *attr, int connfd)
+{
+    cpu_set_t set;
+    int cpu;
+    socklen_t len = sizeof(cpu);
+
+    if (place_mode == AFFINITY_NONE
+        || getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0
+        || cpu < 0 || cpu >= ncpus)
+        return -1;
+
+    if (place_mode == AFFINITY_NODE && cpu_node != NULL && cpu_node[cpu] >= 0)
+        set = node_cpus[cpu_node[cpu]];
+    else{
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set) ? -1 : 0;
+}
+
+
+/*
+ * read_nodes - Build the CPU to node map from the cpulist of every node
+ */
+static void read_nodes(void)
+{
+    char path[64], list[4096], *tok, *save;
+    int node, first, last, cpu;
+    FILE *fp;
+
+    if ((cpu_node = malloc(ncpus * sizeof(int))) == NULL)
+        return;
+    memset(cpu_node, 0xff, ncpus * sizeof(int));    /* -1 : unknown */
+
+    for (node = 0; node < MAX_NODES; node++){
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        if ((fp = fopen(path, "r")) == NULL)
+            continue;
+        CPU_ZERO(&node_cpus[node]);
+        if (fgets(list, sizeof(list), fp) != NULL){
+            /* e.g. "0-15,32-47" */
+            for (tok = strtok_r(list, ",\n", &save); tok != NULL; tok = strtok_r(NULL, ",\n", &save)){
+                switch (sscanf(tok, "%d-%d", &first, &last)){
+                case 1:
+                    last = first;
+                    break;
+                case 2:
+                    break;
+                default:
+                    continue;
+                }
+                for (cpu = first; cpu <= last && cpu < ncpus; cpu++){
+                    CPU_SET(cpu, &node_cpus[node]);
+                    cpu_node[cpu] = node;
+                }
+            }
+        }
+        fclose(fp);
+    }
+}
@@ -0,0 +1,17 @@
+/*
+ * affinity.h - Place connection threads on the CPU or NUMA node of the NIC queue
+ */
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <pthread.h>
+
+/* Placement modes of -A */
+#define AFFINITY_NONE 0
+#define AFFINITY_CPU 1      /* Thread runs on the CPU which received the connection */
+#define AFFINITY_NODE 2     /* Thread runs on any CPU of that CPU's NUMA node */
+
+int affinity_init(int mode);
+int affinity_attr(pthread_attr_t *attr, int connfd);
+
+#endif /* __AFFINITY_H__ */
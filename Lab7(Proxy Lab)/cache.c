@@ -0,0 +1,528 @@
+/*
+ * cache.c - Web object cache with LRU eviction.
+ *
+ *     Objects are found through a chained hash table of their keys, which
+ *     doubles when it holds more objects than chains, and are kept in a
+ *     doubly linked list in LRU order, so lookup and eviction take constant
+ *     time however large the cache is. Both are protected by a reader/writer
+ *     lock. A hit moves its object to the front of the list under the small
+ *     lru_lock, since lookups only hold the read lock.
+ *     Readers take a reference with cache_lookup() and drop it with
+ *     cache_release(), so an object evicted while it is being sent to a
+ *     client is freed only after the last reader is done with it.
+ *
+ *     Pinned objects (the prefetch list) are only in the hash table, so they
+ *     are never chosen as eviction victims. They are only replaced by a newer
+ *     copy of the same URI.
+ *
+ *     Expired objects stay in the list until evicted or replaced, so that
+ *     cache_lookup_stale() can still find them within their stale windows.
+ *
+ *     The size limit can change at run time (memwatch.c); shrinking it evicts
+ *     least recently used objects right away rather than on the next insert.
+ *
+ *     cache_save() and cache_load() copy the whole cache through a file
+ *     (a shared memory object on restart), so a new proxy process starts
+ *     with the objects of the one it replaces.
+ */
+#include "cache.h"
+
+/* Reader/writer lock for cache */
+static pthread_rwlock_t lock;
+
+/* Order of the LRU list, changed by readers on a hit */
+static pthread_mutex_t lru_lock;
+
+#define CACHE_BUCKETS 1024      /* Initial hash chains */
+
+/* Snapshot layout: snap_hdr, then per object a snap_rec, the uri and the data */
+#define SNAP_MAGIC 0x50584333       /* "PXC3" */
+
+typedef struct {
+    unsigned magic;
+    unsigned count;
+} snap_hdr;
+
+typedef struct {
+    size_t uri_len, size, hdr_size, raw_size;
+    time_t expires;
+    int gzipped, pinned, vary, status, stale_revalidate, stale_error;
+} snap_rec;
+
+static cache_obj **table = NULL;    /* Hash chains of all objects */
+static size_t nbuckets = 0;
+static size_t nobjs = 0;
+static cache_obj *lru_head = NULL;  /* Most recently used unpinned object */
+static cache_obj *lru_tail = NULL;  /* Least recently used, the next victim */
+static size_t cache_size = 0;       /* Sum of object sizes in the cache */
+static size_t pinned_size = 0;      /* Part of cache_size which can not be evicted */
+static size_t cache_limit = MAX_CACHE_SIZE;
+size_t cache_max_object = MAX_OBJECT_SIZE;
+
+static cache_obj *find_obj(char *uri);
+static void add_obj(cache_obj *obj);
+static void remove_obj(cache_obj *obj);
+static void grow_table(void);
+static void lru_push(cache_obj *obj);
+static void lru_unlink(cache_obj *obj);
+static void touch(cache_obj *obj);
+static unsigned long long hash_str(char *s);
+
+
+void cache_init(void)
+{
+    pthread_rwlock_init(&lock, NULL);
+    pthread_mutex_init(&lru_lock, NULL);
+    nbuckets = CACHE_BUCKETS;
+    table = Calloc(nbuckets, sizeof(cache_obj *));
+}
+
+
+void cache_deinit(void)
+{
+    size_t i;
+
+    pthread_rwlock_wrlock(&lock);
+    for (i = 0; i < nbuckets; i++)
+        while (table[i] != NULL)
+            remove_obj(table[i]);
+    Free(table);
+    table = NULL;
+    pthread_rwlock_unlock(&lock);
+    pthread_rwlock_destroy(&lock);
+    pthread_mutex_destroy(&lru_lock);
+}
+
+
+/*
+ * cache_lookup - Find the object cached for uri and take a reference to it.
+ *                Expired objects are treated as a miss unless they are pinned;
+ *                a pinned object is served until the refresher replaces it.
+ *                Returns NULL on miss.
+ */
+cache_obj *cache_lookup(char *uri)
+{
+    cache_obj *obj;
+
+    pthread_rwlock_rdlock(&lock);
+    obj = find_obj(uri);
+    if (obj != NULL && !obj->pinned && obj->expires && obj->expires <= time(NULL))
+        obj = NULL;
+    if (obj != NULL){
+        __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+        touch(obj);
+    }
+    pthread_rwlock_unlock(&lock);
+    return obj;
+}
+
+
+/*
+ * cache_lookup_stale - Like cache_lookup(), but an expired object is also returned
+ *                      while it is within its stale-while-revalidate or stale-if-error window.
+ *                      The caller tells fresh from stale with obj->expires.
+ */
+cache_obj *cache_lookup_stale(char *uri)
+{
+    cache_obj *obj;
+    int window;
+
+    pthread_rwlock_rdlock(&lock);
+    obj = find_obj(uri);
+    if (obj != NULL && !obj->pinned && obj->expires){
+        window = (obj->stale_revalidate > obj->stale_error) ? obj->stale_revalidate : obj->stale_error;
+        if (obj->expires + window <= time(NULL))
+            obj = NULL;
+    }
+    if (obj != NULL){
+        __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+        touch(obj);
+    }
+    pthread_rwlock_unlock(&lock);
+    return obj;
+}
+
+
+/*
+ * cache_claim_refresh - Claim the background refresh of obj, so that only one runs.
+ *                       Returns 1 with an extra reference to obj if the caller got it;
+ *                       the refresher clears obj->refreshing and releases obj when done.
+ */
+int cache_claim_refresh(cache_obj *obj)
+{
+    int expected = 0;
+
+    if (!__atomic_compare_exchange_n(&obj->refreshing, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return 0;
+    __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+/*
+ * cache_release - Drop a reference taken by cache_lookup()
+ */
+void cache_release(cache_obj *obj)
+{
+    if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+        Free(obj->uri);
+        Free(obj->data);
+        Free(obj);
+    }
+}
+
+
+/*
+ * cache_new - Make an object for uri from its headers and body.
+ *             The headers must not include Content-Length or the blank line,
+ *             which are added when the object is sent to a client.
+ *             The caller fills in the remaining fields and calls cache_insert().
+ */
+cache_obj *cache_new(char *uri, char *hdr, size_t hdr_size, char *body, size_t body_size)
+{
+    cache_obj *obj = Malloc(sizeof(cache_obj));
+
+    obj->uri = Malloc(strlen(uri) + 1);
+    strcpy(obj->uri, uri);
+    obj->data = Malloc(hdr_size + body_size);
+    memcpy(obj->data, hdr, hdr_size);
+    memcpy(obj->data + hdr_size, body, body_size);
+    obj->size = hdr_size + body_size;
+    obj->hdr_size = hdr_size;
+    obj->raw_size = body_size;
+    obj->gzipped = 0;
+    obj->expires = 0;
+    obj->vary = 0;
+    obj->status = 200;
+    obj->stale_revalidate = 0;
+    obj->stale_error = 0;
+    obj->refreshing = 0;
+    obj->pinned = 0;
+    obj->refcnt = 1;
+    return obj;
+}
+
+
+/*
+ * cache_insert - Insert obj made by cache_new() into the cache.
+ *                An older object with the same key is replaced. A Vary marker
+ *                replacing a pinned one stays pinned, so pinned variants remain reachable.
+ *                Least recently used unpinned objects are evicted to make room.
+ *                Returns 0 on success, -1 if the object does not fit (obj is freed,
+ *                and the cache is left as it was).
+ */
+int cache_insert(cache_obj *obj)
+{
+    cache_obj *victim;
+    char *uri = obj->uri;
+    size_t size = obj->size, kept;
+
+    if (size > cache_max_object){
+        cache_release(obj);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&lock);
+    victim = find_obj(uri);
+    if (victim != NULL && victim->pinned && victim->vary && obj->vary)
+        obj->pinned = 1;
+    /* Pinned objects stay whatever is evicted */
+    kept = pinned_size - ((victim != NULL && victim->pinned) ? victim->size : 0);
+    if (kept + size > cache_limit){
+        pthread_rwlock_unlock(&lock);
+        cache_release(obj);
+        return -1;
+    }
+    if (victim != NULL)
+        remove_obj(victim);
+    while (cache_size + size > cache_limit)
+        remove_obj(lru_tail);
+    add_obj(obj);
+    pthread_rwlock_unlock(&lock);
+    return 0;
+}
+
+
+/*
+ * cache_resize - Set the size limit of the cache, evicting objects until it is met.
+ *                Pinned objects stay even if they alone exceed the limit.
+ */
+void cache_resize(size_t limit)
+{
+    pthread_rwlock_wrlock(&lock);
+    cache_limit = limit;
+    while (cache_size > cache_limit && lru_tail != NULL)
+        remove_obj(lru_tail);
+    pthread_rwlock_unlock(&lock);
+}
+
+
+/*
+ * cache_usage - Bytes cached and the current size limit
+ */
+void cache_usage(size_t *used, size_t *limit)
+{
+    pthread_rwlock_rdlock(&lock);
+    *used = cache_size;
+    *limit = cache_limit;
+    pthread_rwlock_unlock(&lock);
+}
+
+
+/*
+ * cache_save - Write every live object to fd, which is resized to fit.
+ *              Pinned objects are written first, then the others least recently used first.
+ *              Returns the number of objects, or -1 on error.
+ */
+int cache_save(int fd)
+{
+    cache_obj *obj, **objs;
+    snap_hdr sh;
+    snap_rec rec;
+    size_t len = sizeof(snap_hdr);
+    time_t now = time(NULL);
+    char *map, *p;
+    unsigned i;
+    size_t b;
+
+    pthread_rwlock_rdlock(&lock);
+    sh.magic = SNAP_MAGIC;
+    sh.count = 0;
+    objs = Malloc((nobjs + 1) * sizeof(cache_obj *));
+    for (b = 0; b < nbuckets; b++)
+        for (obj = table[b]; obj != NULL; obj = obj->hnext)
+            if (obj->pinned)
+                objs[sh.count++] = obj;
+    pthread_mutex_lock(&lru_lock);
+    for (obj = lru_tail; obj != NULL; obj = obj->prev)
+        if (!obj->expires || obj->expires > now)
+            objs[sh.count++] = obj;
+    pthread_mutex_unlock(&lru_lock);
+    for (i = 0; i < sh.count; i++)
+        len += sizeof(snap_rec) + strlen(objs[i]->uri) + objs[i]->size;
+
+    if (ftruncate(fd, len) < 0
+        || (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        pthread_rwlock_unlock(&lock);
+        Free(objs);
+        return -1;
+    }
+    memcpy(map, &sh, sizeof(sh));
+    p = map + sizeof(sh);
+    for (i = 0; i < sh.count; i++){
+        obj = objs[i];
+        rec.uri_len = strlen(obj->uri);
+        rec.size = obj->size;
+        rec.hdr_size = obj->hdr_size;
+        rec.raw_size = obj->raw_size;
+        rec.expires = obj->expires;
+        rec.gzipped = obj->gzipped;
+        rec.pinned = obj->pinned;
+        rec.vary = obj->vary;
+        rec.status = obj->status;
+        rec.stale_revalidate = obj->stale_revalidate;
+        rec.stale_error = obj->stale_error;
+        memcpy(p, &rec, sizeof(rec));
+        p += sizeof(rec);
+        memcpy(p, obj->uri, rec.uri_len);
+        p += rec.uri_len;
+        memcpy(p, obj->data, obj->size);
+        p += obj->size;
+    }
+    pthread_rwlock_unlock(&lock);
+
+    munmap(map, len);
+    Free(objs);
+    return sh.count;
+}
+
+
+/*
+ * cache_load - Insert the objects of a snapshot written by cache_save().
+ *              Returns the number of objects, or -1 if fd holds no valid snapshot.
+ */
+int cache_load(int fd)
+{
+    struct stat st;
+    snap_hdr sh;
+    snap_rec rec;
+    cache_obj *obj;
+    char *map, *p, *end, *uri;
+    unsigned i;
+
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(snap_hdr)
+        || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        return -1;
+    end = map + st.st_size;
+    memcpy(&sh, map, sizeof(sh));
+    if (sh.magic != SNAP_MAGIC){
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    p = map + sizeof(sh);
+    for (i = 0; i < sh.count && end - p >= sizeof(rec); i++){
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if (rec.uri_len >= MAXLINE || rec.hdr_size > rec.size || end - p < rec.uri_len + rec.size)
+            break;
+        uri = Malloc(rec.uri_len + 1);
+        memcpy(uri, p, rec.uri_len);
+        uri[rec.uri_len] = '\0';
+        p += rec.uri_len;
+        obj = cache_new(uri, p, rec.hdr_size, p + rec.hdr_size, rec.size - rec.hdr_size);
+        Free(uri);
+        p += rec.size;
+        obj->raw_size = rec.raw_size;
+        obj->gzipped = rec.gzipped;
+        obj->expires = rec.expires;
+        obj->pinned = rec.pinned;
+        obj->vary = rec.vary;
+        obj->status = rec.status;
+        obj->stale_revalidate = rec.stale_revalidate;
+        obj->stale_error = rec.stale_error;
+        cache_insert(obj);
+    }
+    munmap(map, st.st_size);
+    return i;
+}
+
+
+/*
+ * find_obj - Search the hash chain of uri. Caller holds the lock.
+ */
+static cache_obj *find_obj(char *uri)
+{
+    cache_obj *obj;
+
+    for (obj = table[hash_str(uri) % nbuckets]; obj != NULL; obj = obj->hnext)
+        if (!strcmp(obj->uri, uri))
+            return obj;
+    return NULL;
+}
+
+
+/*
+ * add_obj - Link obj into its hash chain, and at the front of the LRU list
+ *           unless it is pinned. Caller holds the write lock.
+ */
+static void add_obj(cache_obj *obj)
+{
+    size_t h;
+
+    if (nobjs >= nbuckets)
+        grow_table();
+    h = hash_str(obj->uri) % nbuckets;
+    obj->hnext = table[h];
+    table[h] = obj;
+    if (!obj->pinned)
+        lru_push(obj);
+    else
+        pinned_size += obj->size;
+    nobjs++;
+    cache_size += obj->size;
+}
+
+
+/*
+ * remove_obj - Unlink obj and drop the cache's reference. Caller holds the write lock.
+ */
+static void remove_obj(cache_obj *obj)
+{
+    cache_obj **pp;
+
+    for (pp = &table[hash_str(obj->uri) % nbuckets]; *pp != obj; pp = &(*pp)->hnext)
+        ;
+    *pp = obj->hnext;
+    if (!obj->pinned)
+        lru_unlink(obj);
+    else
+        pinned_size -= obj->size;
+    nobjs--;
+    cache_size -= obj->size;
+    cache_release(obj);
+}
+
+
+/*
+ * grow_table - Double the hash chains and move every object to its new chain.
+ *              Caller holds the write lock.
+ */
+static void grow_table(void)
+{
+    size_t n = nbuckets * 2, i, h;
+    cache_obj **t = Calloc(n, sizeof(cache_obj *)), *obj, *next;
+
+    for (i = 0; i < nbuckets; i++){
+        for (obj = table[i]; obj != NULL; obj = next){
+            next = obj->hnext;
+            h = hash_str(obj->uri) % n;
+            obj->hnext = t[h];
+            t[h] = obj;
+        }
+    }
+    Free(table);
+    table = t;
+    nbuckets = n;
+}
+
+
+/*
+ * lru_push - Put obj at the front of the LRU list. Caller holds the write lock or lru_lock.
+ */
+static void lru_push(cache_obj *obj)
+{
+    obj->prev = NULL;
+    obj->next = lru_head;
+    if (lru_head != NULL)
+        lru_head->prev = obj;
+    else
+        lru_tail = obj;
+    lru_head = obj;
+}
+
+
+/*
+ * lru_unlink - Take obj out of the LRU list. Caller holds the write lock or lru_lock.
+ */
+static void lru_unlink(cache_obj *obj)
+{
+    if (obj->prev != NULL)
+        obj->prev->next = obj->next;
+    else
+        lru_head = obj->next;
+    if (obj->next != NULL)
+        obj->next->prev = obj->prev;
+    else
+        lru_tail = obj->prev;
+}
+
+
+/*
+ * touch - Move obj, which was just used, to the front of the LRU list.
+ *         Caller holds the read lock.
+ */
+static void touch(cache_obj *obj)
+{
+    if (obj->pinned)
+        return;
+    pthread_mutex_lock(&lru_lock);
+    if (lru_head != obj){
+        lru_unlink(obj);
+        lru_push(obj);
+    }
+    pthread_mutex_unlock(&lru_lock);
+}
+
+
+/* FNV-1a 64 */
+static unsigned long long hash_str(char *s)
+{
+    unsigned long long h = 14695981039346656037ULL;
+
+    for (; *s; s++){
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
@@ -0,0 +1,50 @@
+/*
+ * cache.h - Web object cache shared by all proxy threads
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+
+/* Recommended max cache and object sizes (defaults of -m and -o) */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* One cached response, kept in a hash chain and the LRU list */
+typedef struct cache_obj {
+    char *uri;                  /* Cache key (cachekey.c) */
+    char *data;                 /* Status line and headers, followed by body */
+    size_t size;                /* Bytes in data */
+    size_t hdr_size;            /* Bytes of status line and headers (no blank line) */
+    size_t raw_size;            /* Body size before gzip encoding */
+    int gzipped;                /* Body is stored gzip-encoded */
+    time_t expires;             /* Absolute expiry time (0 : never expires) */
+    int vary;                   /* Vary marker: data is the list of header names which
+                                   select a variant, cached under its own key */
+    int status;                 /* Status code of the response (200, or an error for negative entries) */
+    int stale_revalidate;       /* Secs after expiry served stale while one refresh runs */
+    int stale_error;            /* Secs after expiry served stale if the origin fails */
+    int refreshing;             /* A background refresh of this object is running */
+    int pinned;                 /* Pinned objects are never evicted */
+    int refcnt;                 /* Readers using this object (+1 while in the cache) */
+    struct cache_obj *hnext;    /* Next in hash chain */
+    struct cache_obj *prev;     /* LRU list (unpinned objects only), toward the front */
+    struct cache_obj *next;
+} cache_obj;
+
+extern size_t cache_max_object;    /* Largest object cached, set before cache_init() */
+
+void cache_init(void);
+void cache_deinit(void);
+cache_obj *cache_lookup(char *uri);
+cache_obj *cache_lookup_stale(char *uri);
+int cache_claim_refresh(cache_obj *obj);
+void cache_release(cache_obj *obj);
+cache_obj *cache_new(char *uri, char *hdr, size_t hdr_size, char *body, size_t body_size);
+int cache_insert(cache_obj *obj);
+int cache_save(int fd);
+int cache_load(int fd);
+void cache_resize(size_t limit);
+void cache_usage(size_t *used, size_t *limit);
+
+#endif /* __CACHE_H__ */
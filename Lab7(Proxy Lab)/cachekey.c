@@ -0,0 +1,252 @@
+/*
+ * cachekey.c - Canonical cache keys and Vary variants.
+ *
+ *     Clients spell the same URI in many ways, and each spelling would be
+ *     cached and missed separately. cachekey_make() maps a request URI to one
+ *     key: scheme and host are lower case, the default port, an empty query
+ *     and the fragment are dropped, and percent escapes are decoded where they
+ *     stand for unreserved characters and written in upper case otherwise.
+ *     Further rules are chosen with -k, since only the origin knows whether
+ *     they hold:
+ *
+ *         sort     query parameters are sorted (?b=2&a=1 is ?a=1&b=2)
+ *         noquery  the query is ignored
+ *         nocase   the path is lower case
+ *
+ *     A response with a Vary header is one of several representations of
+ *     its URI. It is cached under a variant key, the URI key followed by
+ *     "\nname=value" for each header it varies on, with the values the
+ *     proxy sent to the origin (blanks removed, lower case). The URI key
+ *     itself holds a marker with the list of header names, so a lookup
+ *     first finds the marker, then builds the variant key of the request.
+ */
+#include "cachekey.h"
+
+static int sort_query = 0;      /* Parameter order does not matter to the origin */
+static int drop_query = 0;      /* The query never selects another object */
+static int fold_path = 0;       /* The origin treats paths case-insensitively */
+
+static int append_escaped(char *dst, size_t len, char *src, size_t n, int fold);
+static char *header_value(char *hdrs, char *name, size_t *n);
+static int has_name(char *names, char *name);
+static int param_cmp(const void *a, const void *b);
+
+
+/*
+ * cachekey_init - Enable the key rules listed in opts (comma separated).
+ *                 Returns -1 if opts names an unknown rule.
+ */
+int cachekey_init(char *opts)
+{
+    char buf[MAXLINE], *tok, *save;
+
+    if (strlen(opts) >= MAXLINE)
+        return -1;
+    strcpy(buf, opts);
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+        if (!strcmp(tok, "sort"))
+            sort_query = 1;
+        else if (!strcmp(tok, "noquery"))
+            drop_query = 1;
+        else if (!strcmp(tok, "nocase"))
+            fold_path = 1;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * cachekey_make - Write the canonical key of uri to key (MAXLINE bytes).
+ *                 Returns -1 if uri has no host or the key does not fit.
+ */
+int cachekey_make(char *uri, char *key)
+{
+    char *host = uri, *path, *query, *end, *tok, *save;
+    char qbuf[MAXLINE], *params[KEY_MAX_PARAMS];
+    size_t hlen, i;
+    int len, nparams = 0;
+
+    if (!strncasecmp(uri, "http://", 7))
+        host += 7;
+    hlen = strcspn(host, "/?#");
+    path = host + hlen;
+    if (hlen >= 3 && !strncmp(path - 3, ":80", 3))
+        hlen -= 3;
+    else if (hlen >= 1 && path[-1] == ':')
+        hlen--;
+    if (hlen == 0 || 7 + hlen + 1 >= MAXLINE)
+        return -1;
+
+    strcpy(key, "http://");
+    for (i = 0; i < hlen; i++)
+        key[7 + i] = tolower(host[i]);
+    len = 7 + hlen;
+
+    query = path + strcspn(path, "?#");
+    end = query + strcspn(query, "#");
+    if (path == query)
+        key[len++] = '/';
+    else if ((len = append_escaped(key, len, path, query - path, fold_path)) < 0)
+        return -1;
+    key[len] = '\0';
+    if (*query != '?' || drop_query)
+        return 0;
+
+    /* Empty parameters are dropped, a=1&&b=2 is a=1&b=2 */
+    if (append_escaped(qbuf, 0, query + 1, end - query - 1, 0) < 0)
+        return -1;
+    tok = strtok_r(qbuf, "&", &save);
+    for (; tok != NULL && nparams < KEY_MAX_PARAMS; tok = strtok_r(NULL, "&", &save))
+        params[nparams++] = tok;
+    if (tok != NULL)    /* too many to sort, keep the query as it is */
+        return (append_escaped(key, len, query, end - query, 0) < 0) ? -1 : 0;
+    if (sort_query)
+        qsort(params, nparams, sizeof(char *), param_cmp);
+    for (i = 0; i < nparams; i++){
+        if (len + 1 + strlen(params[i]) >= MAXLINE)
+            return -1;
+        key[len++] = i ? '&' : '?';
+        strcpy(key + len, params[i]);
+        len += strlen(params[i]);
+    }
+    return 0;
+}
+
+
+/*
+ * cachekey_vary - Add the header names in a Vary header value (up to the line end) to names (comma separated,
+ *                 lower case, size bytes). Returns -1 for "Vary: *", which can not be cached,
+ *                 or if names is full.
+ */
+int cachekey_vary(char *value, char *names, size_t size)
+{
+    char buf[MAXLINE], *tok, *save, *p;
+    size_t len = strlen(names);
+
+    snprintf(buf, sizeof(buf), "%.*s", (int)strcspn(value, "\r\n"), value);
+    for (tok = strtok_r(buf, ", \t", &save); tok != NULL; tok = strtok_r(NULL, ", \t", &save)){
+        if (!strcmp(tok, "*"))
+            return -1;
+        for (p = tok; *p; p++)
+            *p = tolower(*p);
+        if (has_name(names, tok))
+            continue;
+        if (len + strlen(tok) + 2 > size)
+            return -1;
+        len += sprintf(names + len, "%s%s", len ? "," : "", tok);
+    }
+    return 0;
+}
+
+
+/*
+ * cachekey_variant - Write the key of the variant of key selected by the request
+ *                    headers hdrs (lines ending in CRLF) to variant (MAXLINE bytes).
+ *                    names is a list made by cachekey_vary(). A missing header has
+ *                    an empty value. Returns -1 if the variant key does not fit.
+ */
+int cachekey_variant(char *key, char *names, char *hdrs, char *variant)
+{
+    char buf[MAXLINE], *name, *save, *value;
+    size_t len = strlen(key), n, i;
+
+    snprintf(buf, sizeof(buf), "%s", names);
+    strcpy(variant, key);
+    for (name = strtok_r(buf, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)){
+        if (len + strlen(name) + 2 >= MAXLINE)
+            return -1;
+        len += sprintf(variant + len, "\n%s=", name);
+        if ((value = header_value(hdrs, name, &n)) == NULL)
+            continue;
+        for (i = 0; i < n; i++){
+            if (value[i] == ' ' || value[i] == '\t')
+                continue;
+            if (len + 1 >= MAXLINE)
+                return -1;
+            variant[len++] = tolower(value[i]);
+        }
+        variant[len] = '\0';
+    }
+    return 0;
+}
+
+
+/*
+ * append_escaped - Append n bytes of src to dst[len], decoding escapes of unreserved
+ *                  characters and writing other escapes in upper case. With fold,
+ *                  letters are made lower case. Returns the new length, -1 if it
+ *                  would not fit in MAXLINE.
+ */
+static int append_escaped(char *dst, size_t len, char *src, size_t n, int fold)
+{
+    char hex[3];
+    int c;
+    size_t i;
+
+    for (i = 0; i < n; i++){
+        if (len + 3 >= MAXLINE)
+            return -1;
+        c = (unsigned char)src[i];
+        if (c == '%' && i + 2 < n && isxdigit(src[i + 1]) && isxdigit(src[i + 2])){
+            hex[0] = src[i + 1];
+            hex[1] = src[i + 2];
+            hex[2] = '\0';
+            c = strtol(hex, NULL, 16);
+            i += 2;
+            if (!isalnum(c) && c != '-' && c != '.' && c != '_' && c != '~'){
+                len += sprintf(dst + len, "%%%02X", c);
+                continue;
+            }
+        }
+        dst[len++] = fold ? tolower(c) : c;
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+
+/*
+ * header_value - Value of header name in hdrs, without leading blanks and the line end.
+ *                Returns NULL if hdrs has no such header.
+ */
+static char *header_value(char *hdrs, char *name, size_t *n)
+{
+    size_t nlen = strlen(name);
+    char *line, *next, *value;
+
+    for (line = hdrs; *line; line = next){
+        next = line + strcspn(line, "\n");
+        if (*next)
+            next++;
+        if (strncasecmp(line, name, nlen) || line[nlen] != ':')
+            continue;
+        value = line + nlen + 1;
+        value += strspn(value, " \t");
+        *n = strcspn(value, "\r\n");
+        return value;
+    }
+    return NULL;
+}
+
+
+/*
+ * has_name - Whether the comma separated list names contains name
+ */
+static int has_name(char *names, char *name)
+{
+    size_t n = strlen(name);
+    char *p;
+
+    for (p = names; (p = strstr(p, name)) != NULL; p += n)
+        if ((p == names || p[-1] == ',') && (p[n] == ',' || p[n] == '\0'))
+            return 1;
+    return 0;
+}
+
+
+static int param_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
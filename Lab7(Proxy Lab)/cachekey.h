@@ -0,0 +1,16 @@
+/*
+ * cachekey.h - Canonical cache keys and Vary variants
+ */
+#ifndef __CACHEKEY_H__
+#define __CACHEKEY_H__
+
+#include "csapp.h"
+
+#define KEY_MAX_PARAMS 64       /* Queries with more parameters are not sorted */
+
+int cachekey_init(char *opts);
+int cachekey_make(char *uri, char *key);
+int cachekey_vary(char *value, char *names, size_t size);
+int cachekey_variant(char *key, char *names, char *hdrs, char *variant);
+
+#endif /* __CACHEKEY_H__ */
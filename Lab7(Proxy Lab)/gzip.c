@@ -0,0 +1,116 @@
+/*
+ * gzip.c - gzip encoding of cached response bodies.
+ *
+ *     Text bodies are stored gzip-encoded in the cache so that they use less
+ *     of the cache. Clients which accept gzip get the cached bytes as they
+ *     are, others get the body inflated on the fly by gzip_decode_writen().
+ */
+#include <zlib.h>
+#include "gzip.h"
+
+/* Content types worth compressing */
+static const char *compressible_types[] = {
+    "text/",
+    "application/json",
+    "application/javascript",
+    "application/x-javascript",
+    "application/xml",
+    "image/svg+xml",
+    NULL
+};
+
+
+/*
+ * gzip_compressible - Return 1 if the body of content_type is worth compressing
+ */
+int gzip_compressible(char *content_type)
+{
+    int i;
+
+    while (*content_type == ' ')
+        content_type++;
+    for (i = 0; compressible_types[i] != NULL; i++)
+        if (!strncasecmp(content_type, compressible_types[i], strlen(compressible_types[i])))
+            return 1;
+    return 0;
+}
+
+
+/*
+ * gzip_encode - Compress srclen bytes of src into dst in gzip format.
+ *               Returns the compressed size, or -1 if it does not fit in dstlen.
+ */
+ssize_t gzip_encode(char *src, size_t srclen, char *dst, size_t dstlen)
+{
+    z_stream strm;
+    ssize_t n;
+
+    memset(&strm, 0, sizeof(strm));
+    /* windowBits 15 + 16 : write a gzip header and trailer instead of zlib's */
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    strm.next_in = (Bytef *)src;
+    strm.avail_in = srclen;
+    strm.next_out = (Bytef *)dst;
+    strm.avail_out = dstlen;
+    n = (deflate(&strm, Z_FINISH) == Z_STREAM_END) ? (ssize_t)strm.total_out : -1;
+    deflateEnd(&strm);
+    return n;
+}
+
+
+/*
+ * gzip_decode - Inflate the gzip data in src into dst.
+ *               Returns the inflated size, or -1 on error or if it does not fit in dstlen.
+ */
+ssize_t gzip_decode(char *src, size_t srclen, char *dst, size_t dstlen)
+{
+    z_stream strm;
+    ssize_t n;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15 + 16) != Z_OK)
+        return -1;
+    strm.next_in = (Bytef *)src;
+    strm.avail_in = srclen;
+    strm.next_out = (Bytef *)dst;
+    strm.avail_out = dstlen;
+    n = (inflate(&strm, Z_FINISH) == Z_STREAM_END) ? (ssize_t)strm.total_out : -1;
+    inflateEnd(&strm);
+    return n;
+}
+
+
+/*
+ * gzip_decode_writen - Inflate the gzip data in src and write the result to fd.
+ *                      Returns the number of bytes written, or -1 on error.
+ */
+ssize_t gzip_decode_writen(int fd, char *src, size_t srclen)
+{
+    z_stream strm;
+    char buf[MAXBUF];
+    ssize_t total = 0;
+    size_t n;
+    int rc;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15 + 16) != Z_OK)
+        return -1;
+    strm.next_in = (Bytef *)src;
+    strm.avail_in = srclen;
+    do {
+        strm.next_out = (Bytef *)buf;
+        strm.avail_out = MAXBUF;
+        rc = inflate(&strm, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END)
+            break;
+        n = MAXBUF - strm.avail_out;
+        if (rio_writen(fd, buf, n) < 0){
+            rc = Z_ERRNO;
+            break;
+        }
+        total += n;
+    } while (rc != Z_STREAM_END);
+    inflateEnd(&strm);
+    return (rc == Z_STREAM_END) ? total : -1;
+}
@@ -0,0 +1,14 @@
+/*
+ * gzip.h - gzip encoding of cached response bodies (zlib)
+ */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include "csapp.h"
+
+int gzip_compressible(char *content_type);
+ssize_t gzip_encode(char *src, size_t srclen, char *dst, size_t dstlen);
+ssize_t gzip_decode(char *src, size_t srclen, char *dst, size_t dstlen);
+ssize_t gzip_decode_writen(int fd, char *src, size_t srclen);
+
+#endif /* __GZIP_H__ */
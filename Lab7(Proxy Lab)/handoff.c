@@ -0,0 +1,231 @@
+/*
+ * handoff.c - Restart without downtime.
+ *
+ *     A proxy started with -H path listens for its successor on the Unix
+ *     socket path. A new proxy started with the same path connects to it,
+ *     and the old one sends two descriptors with SCM_RIGHTS: the listening
+ *     socket and a shared memory object holding a snapshot of its cache.
+ *     The new proxy loads the snapshot, acknowledges, and starts accepting
+ *     on the same socket, so no connection is refused during the restart.
+ *
+ *     Once acknowledged, the old proxy stops accepting, lets the connections
+ *     it already accepted finish (up to HANDOFF_DRAIN_TIMEOUT) and exits.
+ *     If the new proxy dies before acknowledging, the old one keeps serving.
+ */
+#include "handoff.h"
+#include "cache.h"
+#include "ratelimit.h"
+#include "log.h"
+#include <sys/un.h>
+
+volatile sig_atomic_t handoff_done = 0;
+
+static char *sock_path;
+static int handoff_fd;          /* Listening socket for the successor */
+static int server_fd;           /* Listening socket of the proxy */
+static pthread_t main_tid;
+
+static void *handoff_thread(void *vargp);
+static int send_fds(int fd, int *fds, int n);
+static int recv_fds(int fd, int *fds, int n);
+static void wakeup_handler(int sig);
+
+
+/*
+ * handoff_take - Take over the listening socket and cache of the proxy listening on path.
+ *                Returns 0 and sets *listenfd on success, or -1 if no proxy hands over.
+ */
+int handoff_take(char *path, int *listenfd)
+{
+    struct sockaddr_un addr;
+    int fd, fds[2], n;
+    char ack = 1;
+
+    if (strlen(path) >= sizeof(addr.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || recv_fds(fd, fds, 2) < 0){
+        close(fd);
+        return -1;
+    }
+
+    if ((n = cache_load(fds[1])) < 0)
+        log_msg("Cache snapshot is not valid, starting empty.\n");
+    else
+        log_msg("Took over %d cached objects.\n", n);
+    close(fds[1]);
+
+    if (rio_writen(fd, &ack, 1) < 0){
+        close(fds[0]);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    *listenfd = fds[0];
+    return 0;
+}
+
+
+/*
+ * handoff_listen - Wait for a successor on path in a background thread.
+ *                  Must be called from the thread which accepts connections,
+ *                  which is interrupted once the successor took over.
+ */
+void handoff_listen(char *path, int listenfd)
+{
+    struct sockaddr_un addr;
+    struct sigaction action;
+    pthread_t tid;
+
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Handoff path %s is too long\n", path);
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);   /* left by the predecessor */
+    if ((handoff_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || bind(handoff_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(handoff_fd, 1) < 0){
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    /* No SA_RESTART, so the signal makes a blocked accept() return */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wakeup_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
+    sock_path = path;
+    server_fd = listenfd;
+    main_tid = pthread_self();
+    Pthread_create(&tid, NULL, handoff_thread, NULL);
+}
+
+
+/*
+ * handoff_drain - Called once the accept loop stopped after a handoff.
+ *                 Waits until the connections being served are done.
+ *                 Returns 0 once they are, -1 after HANDOFF_DRAIN_TIMEOUT.
+ */
+int handoff_drain(void)
+{
+    int i;
+
+    handoff_done = 2;
+    for (i = 0; i < HANDOFF_DRAIN_TIMEOUT * 10; i++){
+        if (conn_active() == 0)
+            return 0;
+        usleep(100000);
+    }
+    log_msg("%d connections still open, exiting anyway.\n", conn_active());
+    return -1;
+}
+
+
+/*
+ * handoff_thread - Serve successors until one acknowledges the handoff
+ */
+static void *handoff_thread(void *vargp)
+{
+    char name[64], ack;
+    int fd, fds[2];
+
+    Pthread_detach(pthread_self());
+    sprintf(name, "/proxy-handoff-%d", (int)getpid());
+    while (1){
+        if ((fd = accept(handoff_fd, NULL, NULL)) < 0)
+            continue;
+
+        /* Unlinked at once, the successor only reaches it through the descriptor */
+        if ((fds[1] = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0){
+            close(fd);
+            continue;
+        }
+        shm_unlink(name);
+        fds[0] = server_fd;
+        if (cache_save(fds[1]) >= 0 && send_fds(fd, fds, 2) == 0
+            && rio_readn(fd, &ack, 1) == 1){
+            close(fds[1]);
+            close(fd);
+            break;
+        }
+        close(fds[1]);
+        close(fd);
+    }
+
+    /* The successor owns sock_path now */
+    close(handoff_fd);
+    log_msg("Handed over to successor on %s, draining.\n", sock_path);
+    handoff_done = 1;
+
+    /* Repeated until seen, the accepting thread may not be blocked in accept() yet */
+    while (handoff_done == 1){
+        pthread_kill(main_tid, SIGUSR1);
+        usleep(100000);
+    }
+    return NULL;
+}
+
+
+static int send_fds(int fd, int *fds, int n)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte = 0;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+    return (sendmsg(fd, &msg, 0) == 1) ? 0 : -1;
+}
+
+
+static int recv_fds(int fd, int *fds, int n)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    if (recvmsg(fd, &msg, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+        || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(n * sizeof(int)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+    return 0;
+}
+
+
+static void wakeup_handler(int sig)
+{
+}
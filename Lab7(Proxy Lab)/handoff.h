@@ -0,0 +1,18 @@
+/*
+ * handoff.h - Restart without downtime by handing the listening socket
+ *             and the cache to a new proxy process
+ */
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include "csapp.h"
+
+#define HANDOFF_DRAIN_TIMEOUT 30    /* Secs the old proxy waits for its connections */
+
+extern volatile sig_atomic_t handoff_done;
+
+int handoff_take(char *path, int *listenfd);
+void handoff_listen(char *path, int listenfd);
+int handoff_drain(void);
+
+#endif /* __HANDOFF_H__ */
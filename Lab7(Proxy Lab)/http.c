@@ -0,0 +1,150 @@
+/*
+ * http.c - Streaming relay of HTTP message bodies.
+ *
+ *     Bodies are copied through a MAXBUF buffer as they arrive, so a message
+ *     of any size passes through the proxy in constant memory.
+ *     The body is read from a Rio buffer since its first bytes usually
+ *     arrive together with the headers.
+ */
+#include "http.h"
+
+static ssize_t copy_n(rio_t *rp, int fd, size_t n);
+
+
+/*
+ * http_relay_length - Relay a body of n bytes (Content-Length).
+ *                     Returns n, or -1 on error or early EOF.
+ */
+ssize_t http_relay_length(rio_t *rp, int fd, size_t n)
+{
+    return copy_n(rp, fd, n);
+}
+
+
+/*
+ * http_relay_chunked - Relay a chunked body up to and including its trailer.
+ *                      With decode, only the chunk data is written (for HTTP/1.0 peers),
+ *                      otherwise the chunked framing is relayed as it is.
+ *                      Returns the number of data bytes, or -1 on error.
+ */
+ssize_t http_relay_chunked(rio_t *rp, int fd, int decode)
+{
+    char line[MAXLINE], *end;
+    unsigned long size;
+    ssize_t n, total = 0;
+
+    while (1){
+        /* chunk-size [; chunk-ext] CRLF */
+        if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0)
+            return -1;
+        size = strtoul(line, &end, 16);
+        if (end == line)
+            return -1;
+        if (!decode && rio_writen(fd, line, n) < 0)
+            return -1;
+        if (size == 0)
+            break;
+
+        /* chunk-data CRLF */
+        if (copy_n(rp, fd, size) < 0)
+            return -1;
+        total += size;
+        if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0)
+            return -1;
+        if (!decode && rio_writen(fd, line, n) < 0)
+            return -1;
+    }
+
+    /* trailer fields, then the final CRLF */
+    do {
+        if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0)
+            return -1;
+        if (!decode && rio_writen(fd, line, n) < 0)
+            return -1;
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    return total;
+}
+
+
+/*
+ * http_relay_eof - Relay everything up to EOF (body delimited by connection close).
+ *                  Returns the number of bytes, or -1 on error.
+ */
+ssize_t http_relay_eof(rio_t *rp, int fd)
+{
+    char buf[MAXBUF];
+    ssize_t n, total = 0;
+
+    while ((n = rio_readnb(rp, buf, MAXBUF)) > 0){
+        if (rio_writen(fd, buf, n) < 0)
+            return -1;
+        total += n;
+    }
+    return (n < 0) ? -1 : total;
+}
+
+
+/*
+ * http_has_token - Whether the header value contains token (case-insensitive)
+ */
+int http_has_token(char *value, char *token)
+{
+    size_t len = strlen(token);
+
+    for (; *value; value++)
+        if (!strncasecmp(value, token, len))
+            return 1;
+    return 0;
+}
+
+
+/*
+ * http_token_q - Quality value of token in a list such as "gzip;q=0.5, br" (Accept-Encoding).
+ *                Tokens are compared case-insensitively; a token without q has 1.
+ *                A token which is not listed gets the q of "*", or 0 if there is none.
+ */
+double http_token_q(char *value, char *token)
+{
+    size_t len = strlen(token), n;
+    double q, wildcard = 0;
+    char *p = value, *param;
+
+    while (*p && *p != '\r' && *p != '\n'){
+        p += strspn(p, " \t,");
+        n = strcspn(p, " \t;,\r\n");
+        if (n == 0)
+            break;
+        /* parameters up to the next element */
+        q = 1;
+        for (param = p + n; *param && *param != ',' && *param != '\r' && *param != '\n'; param++){
+            if (*param != ';')
+                continue;
+            param += strspn(param + 1, " \t");     /* param + 1 is the name */
+            if (!strncasecmp(param + 1, "q=", 2))
+                q = atof(param + 3);
+        }
+        if (n == len && !strncasecmp(p, token, len))
+            return q;
+        if (n == 1 && *p == '*')
+            wildcard = q;
+        p = param;
+    }
+    return wildcard;
+}
+
+
+static ssize_t copy_n(rio_t *rp, int fd, size_t n)
+{
+    char buf[MAXBUF];
+    size_t left = n;
+    ssize_t rc;
+
+    while (left > 0){
+        if ((rc = rio_readnb(rp, buf, (left < MAXBUF) ? left : MAXBUF)) <= 0)
+            return -1;
+        if (rio_writen(fd, buf, rc) < 0)
+            return -1;
+        left -= rc;
+    }
+    return n;
+}
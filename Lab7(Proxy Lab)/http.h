@@ -0,0 +1,15 @@
+/*
+ * http.h - Streaming relay of HTTP message bodies
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+ssize_t http_relay_length(rio_t *rp, int fd, size_t n);
+ssize_t http_relay_chunked(rio_t *rp, int fd, int decode);
+ssize_t http_relay_eof(rio_t *rp, int fd);
+int http_has_token(char *value, char *token);
+double http_token_q(char *value, char *token);
+
+#endif /* __HTTP_H__ */
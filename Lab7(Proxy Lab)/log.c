@@ -0,0 +1,298 @@
+/*
+ * log.c - Asynchronous access and message log.
+ *
+ *     Proxy threads never write the log themselves. A thread formats its
+ *     record straight into a slot of its own ring, a single producer/single
+ *     consumer queue, and publishes it with a release store of the head;
+ *     no lock is taken and no system call is made on the request path.
+ *
+ *     A writer thread sweeps all rings, copies what they hold into one
+ *     LOG_BATCH buffer per destination (messages to stdout, access records
+ *     and traces to their files) and writes them out in large writes. When a ring is
+ *     full the record is dropped and counted (LOG_DROP), or the thread
+ *     waits for the writer (LOG_BLOCK); drops are reported in the log.
+ *
+ *     Connection threads are short lived, so rings are not freed: a thread
+ *     takes a ring from a pool when it logs for the first time, and gives
+ *     it back when it exits. Records it left are still written afterwards.
+ */
+#include "log.h"
+
+typedef struct log_ring {
+    unsigned long head __attribute__((aligned(64)));   /* Written by the owner */
+    unsigned long tail __attribute__((aligned(64)));   /* Written by the writer */
+    unsigned short len[LOG_RING_SLOTS];
+    char dest[LOG_RING_SLOTS];                          /* LOG_TO_* of each record */
+    char slot[LOG_RING_SLOTS][LOG_LINE_MAX];
+    struct log_ring *next_free;
+} log_ring;
+
+static log_ring *rings[LOG_MAX_RINGS];
+static int nrings = 0;
+static log_ring *free_rings = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread log_ring *my_ring = NULL;
+
+/* Records waiting to be written to one destination */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+} batch_t;
+
+static int dest_fd[LOG_DESTS] = {STDOUT_FILENO, -1, -1};
+static int full_policy = LOG_DROP;
+static unsigned long dropped = 0;
+static volatile int stopping = 0;
+static pthread_t writer_tid;
+
+static void *writer_thread(void *vargp);
+static int sweep(batch_t *out);
+static void batch_add(batch_t *b, char *rec, size_t n);
+static int open_dest(char *path);
+static void log_vput(int dest, const char *fmt, va_list ap);
+static log_ring *get_ring(void);
+static void put_ring(void *ring);
+
+
+/*
+ * log_init - Start the writer thread. Messages go to stdout, access records
+ *            to access_path and trace events to trace_path; without a path
+ *            those records are not logged. A new trace file starts with "[".
+ *            Returns -1 if a path can not be opened.
+ */
+int log_init(char *access_path, char *trace_path, int policy)
+{
+    if ((access_path != NULL && (dest_fd[LOG_TO_ACCESS] = open_dest(access_path)) < 0)
+        || (trace_path != NULL && (dest_fd[LOG_TO_TRACE] = open_dest(trace_path)) < 0))
+        return -1;
+    if (trace_path != NULL && lseek(dest_fd[LOG_TO_TRACE], 0, SEEK_END) == 0)
+        rio_writen(dest_fd[LOG_TO_TRACE], "[\n", 2);
+    full_policy = policy;
+    pthread_key_create(&ring_key, put_ring);
+    Pthread_create(&writer_tid, NULL, writer_thread, NULL);
+    return 0;
+}
+
+
+/*
+ * log_deinit - Write out every record logged so far and stop the writer
+ */
+void log_deinit(void)
+{
+    stopping = 1;
+    pthread_join(writer_tid, NULL);
+}
+
+
+/*
+ * log_msg - Log a message, formatted like printf()
+ */
+void log_msg(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_vput(LOG_TO_STDOUT, fmt, ap);
+    va_end(ap);
+}
+
+
+/*
+ * log_access - Log an access record (only with a log file)
+ */
+void log_access(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (dest_fd[LOG_TO_ACCESS] < 0)
+        return;
+    va_start(ap, fmt);
+    log_vput(LOG_TO_ACCESS, fmt, ap);
+    va_end(ap);
+}
+
+
+/*
+ * log_trace - Log a trace event (only with a trace file)
+ */
+void log_trace(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (dest_fd[LOG_TO_TRACE] < 0)
+        return;
+    va_start(ap, fmt);
+    log_vput(LOG_TO_TRACE, fmt, ap);
+    va_end(ap);
+}
+
+
+/*
+ * open_dest - Open a log file for appending. Returns -1 on error.
+ */
+static int open_dest(char *path)
+{
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+        fprintf(stderr, "Cannot open log %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+
+/*
+ * log_vput - Format a record into the next slot of the caller's ring
+ */
+static void log_vput(int dest, const char *fmt, va_list ap)
+{
+    log_ring *r;
+    unsigned long head;
+    int n, i;
+
+    if ((r = get_ring()) == NULL){
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    head = r->head;
+    while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS){
+        if (full_policy == LOG_DROP){
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        usleep(100);
+    }
+
+    i = head % LOG_RING_SLOTS;
+    n = vsnprintf(r->slot[i], LOG_LINE_MAX, fmt, ap);
+    if (n < 0)
+        return;
+    if (n >= LOG_LINE_MAX){     /* cut, but keep the line break */
+        n = LOG_LINE_MAX - 1;
+        r->slot[i][n - 1] = '\n';
+    }
+    r->len[i] = n;
+    r->dest[i] = dest;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * writer_thread - Write out what the rings hold, in batches
+ */
+static void *writer_thread(void *vargp)
+{
+    batch_t out[LOG_DESTS];
+    int found, i;
+
+    for (i = 0; i < LOG_DESTS; i++){
+        out[i].fd = dest_fd[i];
+        out[i].buf = Malloc(LOG_BATCH);
+        out[i].len = 0;
+    }
+    while (1){
+        found = sweep(out);
+        for (i = 0; i < LOG_DESTS; i++){
+            if (out[i].len > 0)
+                rio_writen(out[i].fd, out[i].buf, out[i].len);
+            out[i].len = 0;
+        }
+        if (!found){
+            if (stopping)
+                break;
+            usleep(LOG_IDLE_USEC);
+        }
+    }
+    for (i = 0; i < LOG_DESTS; i++)
+        Free(out[i].buf);
+    return NULL;
+}
+
+
+/*
+ * sweep - Move the records of all rings to the batch of their destination.
+ *         Returns the number of records found.
+ */
+static int sweep(batch_t *out)
+{
+    log_ring *r;
+    unsigned long head, tail, drops;
+    char msg[64];
+    int i, k, found = 0, count = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < count; i++){
+        r = rings[i];
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (tail = r->tail; tail != head; tail++){
+            k = tail % LOG_RING_SLOTS;
+            batch_add(&out[(int)r->dest[k]], r->slot[k], r->len[k]);
+            found++;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    if ((drops = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)) > 0)
+        batch_add(&out[LOG_TO_STDOUT], msg, sprintf(msg, "Log overloaded, %lu records dropped.\n", drops));
+    return found;
+}
+
+
+/*
+ * batch_add - Append a record to b, writing b out first if it is full
+ */
+static void batch_add(batch_t *b, char *rec, size_t n)
+{
+    if (b->len + n > LOG_BATCH){
+        rio_writen(b->fd, b->buf, b->len);
+        b->len = 0;
+    }
+    memcpy(b->buf + b->len, rec, n);
+    b->len += n;
+}
+
+
+/*
+ * get_ring - Ring of the calling thread, taken from the pool on first use.
+ *            Returns NULL if LOG_MAX_RINGS threads hold one already.
+ */
+static log_ring *get_ring(void)
+{
+    log_ring *r;
+
+    if (my_ring != NULL)
+        return my_ring;
+
+    pthread_mutex_lock(&pool_lock);
+    if ((r = free_rings) != NULL)
+        free_rings = r->next_free;
+    else if (nrings < LOG_MAX_RINGS){
+        /* Malloc only aligns to 16 bytes; head and tail need their own cache lines */
+        if ((errno = posix_memalign((void **)&r, 64, sizeof(log_ring))) != 0)
+            unix_error("posix_memalign error");
+        r->head = r->tail = 0;
+        rings[nrings] = r;
+        __atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (r != NULL){
+        my_ring = r;
+        pthread_setspecific(ring_key, r);
+    }
+    return r;
+}
+
+
+/*
+ * put_ring - Give the ring of an exiting thread back to the pool
+ */
+static void put_ring(void *ring)
+{
+    log_ring *r = ring;
+
+    pthread_mutex_lock(&pool_lock);
+    r->next_free = free_rings;
+    free_rings = r;
+    pthread_mutex_unlock(&pool_lock);
+}
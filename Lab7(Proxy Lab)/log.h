@@ -0,0 +1,31 @@
+/*
+ * log.h - Asynchronous access and message log
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "csapp.h"
+
+#define LOG_LINE_MAX 512        /* Longest record, longer ones are cut */
+#define LOG_RING_SLOTS 256      /* Records buffered per thread */
+#define LOG_MAX_RINGS 1024      /* Threads which can log at the same time */
+#define LOG_BATCH 65536         /* Bytes written by the writer thread at once */
+#define LOG_IDLE_USEC 10000     /* Writer sleeps this long when all rings are empty */
+
+/* Destinations of records */
+#define LOG_TO_STDOUT 0         /* Messages */
+#define LOG_TO_ACCESS 1         /* Access records (-l) */
+#define LOG_TO_TRACE 2          /* Trace events (-t) */
+#define LOG_DESTS 3
+
+/* What a thread does when its ring is full */
+#define LOG_DROP 0              /* Drop the record and count it */
+#define LOG_BLOCK 1             /* Wait for the writer */
+
+int log_init(char *access_path, char *trace_path, int policy);
+void log_deinit(void);
+void log_msg(const char *fmt, ...);
+void log_access(const char *fmt, ...);
+void log_trace(const char *fmt, ...);
+
+#endif /* __LOG_H__ */
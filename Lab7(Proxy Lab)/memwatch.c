@@ -0,0 +1,186 @@
+/*
+ * memwatch.c - Adapt the cache size to available memory and memory pressure.
+ *
+ *     Every MEMWATCH_INTERVAL seconds a background thread computes a target
+ *     of fraction * (available memory + bytes already cached). Available
+ *     memory is MemAvailable from /proc/meminfo, lowered to the headroom
+ *     left under the memory limit of the proxy's cgroup (v2 or v1).
+ *
+ *     Under memory pressure (PSI "some avg10" of the cgroup, or of the
+ *     whole system if the cgroup has none) the limit drops by a quarter and
+ *     cache_resize() evicts at once, before the kernel starts reclaiming.
+ *     Without pressure the limit grows toward the target by 1/MEMWATCH_GROW_STEPS
+ *     of it per step, and it shrinks to the target when memory got scarce.
+ *     It never goes below floor, the size given with -m.
+ */
+#include "memwatch.h"
+#include "cache.h"
+#include "log.h"
+
+#define UNLIMITED (1ULL << 60)      /* Larger cgroup limits mean "max" */
+
+static double mem_fraction;
+static size_t mem_floor;
+static char pressure_path[2*MAXLINE];
+static char limit_path[2*MAXLINE];   /* memory.max or memory.limit_in_bytes */
+static char usage_path[2*MAXLINE];   /* memory.current or memory.usage_in_bytes */
+
+static void *memwatch_thread(void *vargp);
+static void find_cgroup(void);
+static size_t mem_available(void);
+static double mem_pressure(void);
+static int read_ull(char *path, unsigned long long *val);
+
+
+/*
+ * memwatch_start - Start adapting the cache size to fraction of available memory
+ */
+void memwatch_start(double fraction, size_t floor)
+{
+    pthread_t tid;
+
+    mem_fraction = fraction;
+    mem_floor = floor;
+    find_cgroup();
+    Pthread_create(&tid, NULL, memwatch_thread, NULL);
+}
+
+
+static void *memwatch_thread(void *vargp)
+{
+    size_t used, limit, target, next;
+    double pressure;
+
+    Pthread_detach(pthread_self());
+    while (1){
+        cache_usage(&used, &limit);
+        target = mem_fraction * (mem_available() + used);
+        if (target < mem_floor)
+            target = mem_floor;
+        pressure = mem_pressure();
+
+        if (pressure >= MEMWATCH_PRESSURE_HIGH)
+            next = limit / 4 * 3;
+        else if (limit > target)
+            next = target;
+        else if (pressure < MEMWATCH_PRESSURE_LOW)
+            next = limit + target / MEMWATCH_GROW_STEPS;
+        else
+            next = limit;
+        if (next > target)
+            next = target;
+        if (next < mem_floor)
+            next = mem_floor;
+
+        if (next != limit){
+            log_msg("Cache limit %zu -> %zu bytes (pressure %.2f).\n", limit, next, pressure);
+            cache_resize(next);
+        }
+        Sleep(MEMWATCH_INTERVAL);
+    }
+    return NULL;
+}
+
+
+/*
+ * find_cgroup - Locate the pressure and limit files of the proxy's cgroup
+ */
+static void find_cgroup(void)
+{
+    FILE *fp;
+    char line[MAXLINE], *path, file[2*MAXLINE];
+    char *roots[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"};
+    unsigned long long val;
+    int i;
+
+    strcpy(pressure_path, "/proc/pressure/memory");
+    limit_path[0] = usage_path[0] = '\0';
+    if ((fp = fopen("/proc/self/cgroup", "r")) == NULL)
+        return;
+    while (fgets(line, MAXLINE, fp) != NULL){
+        line[strcspn(line, "\n")] = '\0';
+        if (!strncmp(line, "0::", 3)){
+            /* v2 unified hierarchy */
+            path = line + 3;
+            for (i = 0; i < 2; i++){
+                snprintf(file, sizeof(file), "%s%s/memory.pressure", roots[i], path);
+                if (access(file, R_OK) == 0)
+                    snprintf(pressure_path, sizeof(pressure_path), "%s", file);
+                snprintf(file, sizeof(file), "%s%s/memory.max", roots[i], path);
+                if (read_ull(file, &val) == 0){
+                    snprintf(limit_path, sizeof(limit_path), "%s", file);
+                    snprintf(usage_path, sizeof(usage_path), "%s%s/memory.current", roots[i], path);
+                }
+            }
+        }
+        else if ((path = strstr(line, ":memory:")) != NULL && !limit_path[0]){
+            /* v1 memory controller */
+            snprintf(limit_path, sizeof(limit_path), "/sys/fs/cgroup/memory%s/memory.limit_in_bytes", path + 8);
+            snprintf(usage_path, sizeof(usage_path), "/sys/fs/cgroup/memory%s/memory.usage_in_bytes", path + 8);
+        }
+    }
+    fclose(fp);
+}
+
+
+/*
+ * mem_available - Bytes the proxy can still use
+ */
+static size_t mem_available(void)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    unsigned long long avail = 0, limit, usage;
+
+    if ((fp = fopen("/proc/meminfo", "r")) != NULL){
+        while (fgets(line, MAXLINE, fp) != NULL)
+            if (sscanf(line, "MemAvailable: %llu kB", &avail) == 1)
+                break;
+        fclose(fp);
+        avail *= 1024;
+    }
+    if (limit_path[0] && read_ull(limit_path, &limit) == 0 && limit < UNLIMITED
+        && read_ull(usage_path, &usage) == 0)
+        if (limit < usage + avail)
+            avail = (limit > usage) ? limit - usage : 0;
+    return avail;
+}
+
+
+/*
+ * mem_pressure - Share of time (%) some task stalled on memory over the last 10 secs
+ */
+static double mem_pressure(void)
+{
+    FILE *fp;
+    double avg10 = 0;
+
+    if ((fp = fopen(pressure_path, "r")) != NULL){
+        if (fscanf(fp, "some avg10=%lf", &avg10) != 1)
+            avg10 = 0;
+        fclose(fp);
+    }
+    return avg10;
+}
+
+
+/* A number, or UNLIMITED for "max" */
+static int read_ull(char *path, unsigned long long *val)
+{
+    FILE *fp;
+    char buf[64];
+    int rc = -1;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    if (fgets(buf, sizeof(buf), fp) != NULL){
+        if (!strncmp(buf, "max", 3)){
+            *val = UNLIMITED;
+            rc = 0;
+        }
+        else if (sscanf(buf, "%llu", val) == 1)
+            rc = 0;
+    }
+    fclose(fp);
+    return rc;
+}
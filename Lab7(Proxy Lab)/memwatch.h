@@ -0,0 +1,16 @@
+/*
+ * memwatch.h - Adapt the cache size to available memory and memory pressure
+ */
+#ifndef __MEMWATCH_H__
+#define __MEMWATCH_H__
+
+#include "csapp.h"
+
+#define MEMWATCH_INTERVAL 5         /* Secs between two adjustments */
+#define MEMWATCH_PRESSURE_HIGH 10.0 /* PSI "some avg10" (%) above which the cache shrinks */
+#define MEMWATCH_PRESSURE_LOW 1.0   /* PSI "some avg10" (%) below which the cache may grow */
+#define MEMWATCH_GROW_STEPS 8       /* Growth per adjustment is 1/8 of the target */
+
+void memwatch_start(double fraction, size_t floor);
+
+#endif /* __MEMWATCH_H__ */
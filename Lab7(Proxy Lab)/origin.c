@@ -0,0 +1,112 @@
+/*
+ * origin.c - Remember origin servers which could not be reached.
+ *
+ *     While an origin is down, every request for it would otherwise wait for
+ *     its own connect() to fail. Failed origins are kept in a direct mapped
+ *     table for ORIGIN_RETRY seconds, during which requests for them fail at
+ *     once (or are answered from stale cached copies).
+ *
+ *     A collision simply replaces the older entry; forgetting a failed
+ *     origin only costs one more connection attempt.
+ *
+ *     origin_connect() is open_clientfd() with both steps, name lookup and
+ *     connect, marked as phases of the request trace.
+ */
+#include "origin.h"
+
+typedef struct {
+    char host[256];
+    int port;
+    time_t down_until;
+} origin_t;
+
+static origin_t origins[ORIGIN_SLOTS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned slot_of(char *host, int port);
+
+
+/*
+ * origin_failed - host:port could not be reached, fail requests for it for a while
+ */
+void origin_failed(char *host, int port)
+{
+    origin_t *o = &origins[slot_of(host, port)];
+
+    if (strlen(host) >= sizeof(o->host))
+        return;
+    pthread_mutex_lock(&lock);
+    strcpy(o->host, host);
+    o->port = port;
+    o->down_until = time(NULL) + ORIGIN_RETRY;
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * origin_down - Whether host:port failed less than ORIGIN_RETRY seconds ago
+ */
+int origin_down(char *host, int port)
+{
+    origin_t *o = &origins[slot_of(host, port)];
+    int down;
+
+    pthread_mutex_lock(&lock);
+    down = (o->port == port && o->down_until > time(NULL) && !strcasecmp(o->host, host));
+    pthread_mutex_unlock(&lock);
+    return down;
+}
+
+
+/*
+ * origin_connect - Connect to host:port unless it is down, and remember it if it fails.
+ *                  Returns the socket, or -1 if the origin can not be reached.
+ */
+int origin_connect(char *host, int port, trace_t *t)
+{
+    struct addrinfo hints, *listp, *p;
+    char portstr[16];
+    int fd = -1, rc;
+
+    if (origin_down(host, port))
+        return -1;
+
+    trace_mark(t, "dns");
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    sprintf(portstr, "%d", port);
+    if ((rc = getaddrinfo(host, portstr, &hints, &listp)) != 0){
+        origin_failed(host, port);
+        return -1;
+    }
+
+    trace_mark(t, "connect");
+    for (p = listp; p; p = p->ai_next){
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(listp);
+    if (fd < 0)
+        origin_failed(host, port);
+    return fd;
+}
+
+
+/* FNV-1a of the lower case host and the port */
+static unsigned slot_of(char *host, int port)
+{
+    unsigned h = 2166136261u;
+
+    for (; *host; host++){
+        h ^= (unsigned char)tolower(*host);
+        h *= 16777619u;
+    }
+    h ^= port;
+    h *= 16777619u;
+    return h % ORIGIN_SLOTS;
+}
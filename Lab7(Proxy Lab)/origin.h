@@ -0,0 +1,17 @@
+/*
+ * origin.h - Remember origin servers which could not be reached
+ */
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include "csapp.h"
+#include "trace.h"
+
+#define ORIGIN_SLOTS 1024       /* Origins remembered at once */
+#define ORIGIN_RETRY 5          /* Secs before an unreachable origin is tried again */
+
+void origin_failed(char *host, int port);
+int origin_down(char *host, int port);
+int origin_connect(char *host, int port, trace_t *t);
+
+#endif /* __ORIGIN_H__ */
@@ -0,0 +1,137 @@
+/*
+ * peer.c - Consistent hashing of URIs over a cluster of peer proxies.
+ *
+ *     Every proxy of the cluster is started with the same member list, so
+ *     every proxy builds the same ring: PEER_VNODES points per member, sorted
+ *     by hash. A URI belongs to the first point at or after its hash. Adding
+ *     or removing a member only moves the URIs next to its points, so the
+ *     rest of the cluster keeps its cached objects.
+ *
+ *     The ring is built once at startup and only read afterwards. Only the
+ *     down_until times change, and threads read and write them atomically.
+ */
+#include "peer.h"
+
+typedef struct {
+    unsigned long long hash;
+    int peer;
+} vnode;
+
+static peer_t peers[MAX_PEERS];
+static int npeers = 0;
+static vnode ring[MAX_PEERS * PEER_VNODES];
+static int nvnodes = 0;
+
+static unsigned long long hash_str(char *s);
+static int vnode_cmp(const void *a, const void *b);
+
+
+/*
+ * peer_add - Add host:port to the cluster. Duplicates are merged.
+ *            Returns -1 if hostport is malformed or there are too many peers.
+ */
+int peer_add(char *hostport, int self)
+{
+    char *colon = strrchr(hostport, ':');
+    int i;
+
+    if (colon == NULL || colon == hostport || colon - hostport >= MAXLINE || strlen(colon + 1) >= 16)
+        return -1;
+    for (i = 0; i < npeers; i++){
+        if (!strncmp(peers[i].host, hostport, colon - hostport) && peers[i].host[colon - hostport] == '\0'
+            && !strcmp(peers[i].port, colon + 1)){
+            peers[i].self |= self;
+            return 0;
+        }
+    }
+    if (npeers == MAX_PEERS)
+        return -1;
+    memcpy(peers[npeers].host, hostport, colon - hostport);
+    peers[npeers].host[colon - hostport] = '\0';
+    strcpy(peers[npeers].port, colon + 1);
+    peers[npeers].self = self;
+    peers[npeers].down_until = 0;
+    npeers++;
+    return 0;
+}
+
+
+/*
+ * peer_init - Build the hash ring from the members added so far
+ */
+void peer_init(void)
+{
+    char key[MAXLINE + 64];
+    int i, j;
+
+    nvnodes = 0;
+    for (i = 0; i < npeers; i++){
+        for (j = 0; j < PEER_VNODES; j++){
+            sprintf(key, "%s:%s#%d", peers[i].host, peers[i].port, j);
+            ring[nvnodes].hash = hash_str(key);
+            ring[nvnodes].peer = i;
+            nvnodes++;
+        }
+    }
+    qsort(ring, nvnodes, sizeof(vnode), vnode_cmp);
+}
+
+
+/*
+ * peer_owner - Peer which caches uri. Returns NULL if this proxy owns uri,
+ *              there is no cluster, or the owner failed recently.
+ */
+peer_t *peer_owner(char *uri)
+{
+    unsigned long long h;
+    int lo = 0, hi = nvnodes;
+    peer_t *peer;
+
+    if (nvnodes == 0)
+        return NULL;
+
+    /* First point with hash >= h, wrapping around */
+    h = hash_str(uri);
+    while (lo < hi){
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    peer = &peers[ring[lo % nvnodes].peer];
+
+    if (peer->self || __atomic_load_n(&peer->down_until, __ATOMIC_RELAXED) > time(NULL))
+        return NULL;
+    return peer;
+}
+
+
+/*
+ * peer_failed - Stop asking peer for PEER_RETRY seconds
+ */
+void peer_failed(peer_t *peer)
+{
+    __atomic_store_n(&peer->down_until, time(NULL) + PEER_RETRY, __ATOMIC_RELAXED);
+}
+
+
+/* FNV-1a 64 */
+static unsigned long long hash_str(char *s)
+{
+    unsigned long long h = 14695981039346656037ULL;
+
+    for (; *s; s++){
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+static int vnode_cmp(const void *a, const void *b)
+{
+    unsigned long long x = ((vnode *)a)->hash, y = ((vnode *)b)->hash;
+
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,25 @@
+/*
+ * peer.h - Consistent hashing of URIs over a cluster of peer proxies
+ */
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include "csapp.h"
+
+#define MAX_PEERS 64
+#define PEER_VNODES 100     /* Points of each peer on the hash ring */
+#define PEER_RETRY 10       /* Secs before a peer which failed is asked again */
+
+typedef struct {
+    char host[MAXLINE];
+    char port[16];
+    int self;               /* This proxy */
+    time_t down_until;      /* Not asked before this time after a failure (atomic) */
+} peer_t;
+
+int peer_add(char *hostport, int self);
+void peer_init(void);
+peer_t *peer_owner(char *uri);
+void peer_failed(peer_t *peer);
+
+#endif /* __PEER_H__ */
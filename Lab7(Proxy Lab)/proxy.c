@@ -1,150 +1,1410 @@
 #include <stdio.h>
 #include "csapp.h"
+#include "cache.h"
+#include "gzip.h"
+#include "range.h"
+#include "ratelimit.h"
+#include "tunnel.h"
+#include "uring.h"
+#include "peer.h"
+#include "http.h"
+#include "handoff.h"
+#include "memwatch.h"
+#include "affinity.h"
+#include "log.h"
+#include "origin.h"
+#include "cachekey.h"
+#include "trace.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#define DEFAULT_PIN_TTL 60  /* Refresh interval of pinned objects without max-age (secs) */
+#define PREFETCH_RETRY 5    /* Retry interval after a failed prefetch (secs) */
+#define NEGATIVE_TTL 10     /* How long error responses without max-age are cached (secs) */
+#define STALE_REVALIDATE 30 /* stale-while-revalidate if the origin gives none (secs) */
+#define STALE_IF_ERROR 300  /* stale-if-error if the origin gives none (secs) */
+#define MAX_CONNECT_PORTS 16    /* Ports in the CONNECT allow-list (-C) */
 
-pthread_rwlock_t lock;
+/* Entry of prefetch list. Objects in this list are pinned in the cache */
+typedef struct prefetch_t {
+    char uri[MAXLINE];
+    char key[MAXLINE];      /* Cache key of uri */
+    int ttl;                /* Refresh interval if origin gives no max-age */
+    time_t next_refresh;    /* When the pinned copy has to be fetched again */
+    struct prefetch_t *next;
+} prefetch_t;
+
+/* Accepted connection handed to its thread */
+typedef struct {
+    int fd;
+    long accepted;          /* trace_now() when it was accepted */
+} conn_t;
+
+/* Request read from client */
+typedef struct {
+    char method[MAXLINE];
+    char uri[MAXLINE];
+    char version[MAXLINE];
+    char key[MAXLINE];      /* Cache key of uri */
+    int accept_gzip;        /* Client accepts gzip content coding */
+    char vary_hdrs[MAXLINE];    /* Content negotiation headers sent to the origin with GET */
+    char range[MAXLINE];    /* Value of Range header ("" if there is none) */
+    int if_range;           /* Client sent If-Range */
+    int from_peer;          /* Request was forwarded by a peer proxy */
+    char hdrs[MAXBUF];      /* End-to-end headers forwarded with a request body */
+    size_t hdrs_len;
+    long content_length;    /* Of the request body (-1 if there is none) */
+    int chunked;            /* Request body has chunked transfer coding */
+    int expect_continue;    /* Client waits for 100 Continue before sending the body */
+    int status;             /* Status sent to the client (0 if none) */
+    ssize_t bytes;          /* Body bytes sent to the client (-1 if not known) */
+    char *result;           /* How it was answered: HIT, STALE, MISS, PEER, PASS, TUNNEL */
+    trace_t trace;          /* Phase timestamps */
+} request_t;
+
+/* Background refresh of a stale object */
+typedef struct {
+    cache_obj *obj;
+    char uri[MAXLINE];      /* Request which found it stale */
+    char key[MAXLINE];
+    char vary_hdrs[MAXLINE];
+} refresh_t;
+
+/* Response read from origin server or peer by fetch_uri() */
+typedef struct {
+    char *buf;              /* Copy of the response while it fits in cache_max_object */
+    size_t cap;             /* Bytes allocated for buf, grown as the response arrives */
+    size_t size;            /* Bytes of the response */
+    size_t hdr_size;        /* Bytes of status line and headers including blank line */
+    int status;             /* Status code */
+    int whole;              /* The whole response is in buf */
+    int cacheable;          /* Whole response from origin is in buf, status is 200 or negative_status() */
+    time_t expires;         /* From Cache-Control max-age (0 if there is none) */
+    int stale_revalidate;   /* From Cache-Control (-1 if there is none) */
+    int stale_error;
+    trace_t *trace;         /* Phases of the fetch are marked here (NULL : not traced) */
+} response_t;
+
+/* Progress of fetch_uri() through a response body */
+typedef struct {
+    response_t *resp;
+    size_t objsize;         /* Bytes copied to resp->buf */
+    ssize_t total;          /* Bytes of the response so far */
+} fetch_state;
+
+prefetch_t *prefetch_list = NULL;
+int compress_cache = 0;     /* Store compressible bodies gzip-encoded */
+int use_uring = 0;          /* Use io_uring for accepts and body relay */
+int placement = AFFINITY_NONE;  /* Where connection threads run (-A) */
+int connect_ports[MAX_CONNECT_PORTS] = {443};   /* Ports CONNECT may open tunnels to (-C) */
+int nconnect_ports = 1;
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *conn_hdr = "Connection: close\r\n";
 static const char *prox_hdr = "Proxy-Connection: close\r\n";
+static char *gzip_hdr = "Accept-Encoding: gzip\r\n";
+static char *stale_warning = "Warning: 110 - \"Response is Stale\"\r\n";
 
 
 /* Functions */
-void doit(int connfd);
+void doit(int connfd, long accepted);
+void serve_request(int connfd, rio_t *rp, request_t *req);
+void log_request(int connfd, request_t *req, struct timespec *start);
 void *thread(void *vargp);
+void accept_conn(int connfd, struct sockaddr *addr);
+void reject(int connfd, char *status);
+void read_requesthdrs(rio_t *rp, request_t *req);
 int parse_uri(char *uri, char *hostname, char *path, int *port);
+ssize_t fetch_object(request_t *req, char *extra_hdrs, int connfd, response_t *resp);
+ssize_t fetch_uri(char *uri, char *extra_hdrs, peer_t *peer, int connfd, response_t *resp);
+ssize_t relay_body(rio_t *rp, int connfd, fetch_state *st);
+ssize_t relay_body_uring(rio_t *rp, int connfd, fetch_state *st);
+int keep_chunk(char *buf, size_t n, void *arg);
+void serve_range_miss(int connfd, request_t *req);
+void serve_cached(int connfd, request_t *req, cache_obj *obj, int stale);
+void serve_stale_if_error(int connfd, request_t *req, cache_obj *stale);
+cache_obj *lookup_variant(request_t *req);
+void revalidate(request_t *req, cache_obj *obj);
+void *revalidate_thread(void *vargp);
+void send_error(int connfd, request_t *req, int status, char *reason);
+int negative_status(int status);
+void do_connect(int connfd, rio_t *rp, request_t *req);
+void do_forward(int connfd, rio_t *rp, request_t *req);
+ssize_t relay_response(rio_t *rp, int connfd, int client_v10, int *status, trace_t *t);
+int cache_response(char *key, char *vary_hdrs, response_t *resp, int pinned);
+int serve_obj(int connfd, cache_obj *obj, int accept_gzip, int stale);
+int has_header(cache_obj *obj, char *name);
+size_t parse_size(char *s);
+int parse_ports(char *list);
+int load_prefetch(char *filename);
+void *refresh_thread(void *vargp);
+int prefetch(prefetch_t *entry, char *vary_hdrs, response_t *resp);
 void close_wrapper(int fd);
 
 
 int main(int argc, char **argv)
 {
-    int listenfd, *connfdp;
+    int listenfd, connfd, c;
     socklen_t clientlen;
-    struct sockaddr_in clientaddr;
+    struct sockaddr_storage clientaddr;
     pthread_t tid;
-    
+    char *prefetch_file = NULL, *handoff_path = NULL, *log_file = NULL, *trace_file = NULL;
+    double rate = 0, burst = 0;
+    int max_conns = 0, cluster = 0;
+    size_t cache_limit = MAX_CACHE_SIZE;
+    double mem_fraction = 0, trace_sample = TRACE_SAMPLE;
+    long trace_slow = TRACE_SLOW_MS;
+    int log_policy = LOG_DROP;
+
 
-    if(argc != 2){
-        fprintf(stderr,"Usage :%s <port> \n", argv[0]);
+    while ((c = getopt(argc, argv, "p:zr:b:c:uP:S:H:m:o:a:A:l:L:k:t:s:w:C:")) != -1){
+        switch (c){
+        case 'p':   /* list of URIs to prefetch and pin */
+            prefetch_file = optarg;
+            break;
+        case 'z':   /* store text bodies gzip-encoded in cache */
+            compress_cache = 1;
+            break;
+        case 'r':   /* connections per second per client */
+            rate = atof(optarg);
+            break;
+        case 'b':   /* burst of connections per client */
+            burst = atof(optarg);
+            break;
+        case 'c':   /* max concurrent connections */
+            max_conns = atoi(optarg);
+            break;
+        case 'u':   /* io_uring backend */
+            use_uring = 1;
+            break;
+        case 'P':   /* member of the peer cache cluster (host:port) */
+        case 'S':   /* this proxy in the cluster (host:port) */
+            if (peer_add(optarg, c == 'S') < 0){
+                fprintf(stderr, "Bad peer %s\n", optarg);
+                exit(1);
+            }
+            cluster = 1;
+            break;
+        case 'H':   /* unix socket for handing over to a restarted proxy */
+            handoff_path = optarg;
+            break;
+        case 'm':   /* cache size (bytes, K, M or G) */
+            cache_limit = parse_size(optarg);
+            break;
+        case 'o':   /* max object size (bytes, K, M or G) */
+            cache_max_object = parse_size(optarg);
+            break;
+        case 'a':   /* adapt cache size to this fraction of available memory */
+            mem_fraction = atof(optarg);
+            break;
+        case 'A':   /* run connection threads on the NIC queue's cpu or node */
+            placement = !strcmp(optarg, "cpu") ? AFFINITY_CPU : !strcmp(optarg, "node") ? AFFINITY_NODE : -1;
+            break;
+        case 'l':   /* access log file */
+            log_file = optarg;
+            break;
+        case 'L':   /* when the log can not keep up: drop records or wait */
+            log_policy = !strcmp(optarg, "drop") ? LOG_DROP : !strcmp(optarg, "block") ? LOG_BLOCK : -1;
+            break;
+        case 'k':   /* cache key rules: sort, noquery, nocase */
+            if (cachekey_init(optarg) < 0){
+                fprintf(stderr, "Bad cache key rules %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':   /* trace file (Chrome trace format) */
+            trace_file = optarg;
+            break;
+        case 's':   /* fraction of requests traced */
+            trace_sample = atof(optarg);
+            break;
+        case 'w':   /* requests slower than this (msecs) are always traced */
+            trace_slow = atol(optarg);
+            break;
+        case 'C':   /* ports CONNECT may tunnel to (comma separated) */
+            if (parse_ports(optarg) < 0){
+                fprintf(stderr, "Bad CONNECT ports %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr,"Usage :%s [-p prefetch_file] [-z] [-r rate] [-b burst] [-c max_conns] [-u] [-S self -P peer...] [-H handoff_socket] [-m cache_size] [-o max_object] [-a mem_fraction] [-A cpu|node] [-l access_log] [-L drop|block] [-k sort,noquery,nocase] [-t trace_file] [-s sample] [-w slow_ms] [-C connect_ports] <port> \n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if(argc != optind + 1 || cache_limit == 0 || cache_max_object == 0 || mem_fraction < 0 || mem_fraction >= 1
+       || placement < 0 || log_policy < 0 || trace_sample < 0 || trace_sample > 1 || trace_slow < 0){
+        fprintf(stderr,"Usage :%s [-p prefetch_file] [-z] [-r rate] [-b burst] [-c max_conns] [-u] [-S self -P peer...] [-H handoff_socket] [-m cache_size] [-o max_object] [-a mem_fraction] [-A cpu|node] [-l access_log] [-L drop|block] [-k sort,noquery,nocase] [-t trace_file] [-s sample] [-w slow_ms] [-C connect_ports] <port> \n", argv[0]);
         exit(1);
     }
 
     // ignore sigpipes
     signal(SIGPIPE, SIG_IGN);
 
-    // initialize reader/writer lock for cache
-    pthread_rwlock_init(&lock, NULL);
+    // messages, access records and traces are written by a background thread
+    if (log_init(log_file, trace_file, log_policy) < 0)
+        exit(1);
+    if (trace_file != NULL)
+        trace_init(trace_sample, trace_slow);
+
+    // initialize cache and admission control
+    cache_init();
+    cache_resize(cache_limit);
+    if (mem_fraction > 0)
+        memwatch_start(mem_fraction, cache_limit);
+    ratelimit_init(rate, (burst > 0) ? burst : rate, max_conns);
+    if (cluster)
+        peer_init();
+    if (placement != AFFINITY_NONE && affinity_init(placement) < 0){
+        log_msg("SO_INCOMING_CPU is not available, threads are not placed.\n");
+        placement = AFFINITY_NONE;
+    }
+    if (use_uring && uring_init() < 0){
+        log_msg("io_uring is not available, using read/write.\n");
+        use_uring = 0;
+    }
 
     // establish client port (default: 29094)
-    if (!argv[1]){
-        printf("Missing command line port number\n");
+    if (!argv[optind]){
+        log_msg("Missing command line port number\n");
         return -1;
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    // fill and keep refreshing pinned objects in background
+    if (prefetch_file != NULL){
+        if (load_prefetch(prefetch_file) < 0)
+            exit(1);
+        Pthread_create(&tid, NULL, refresh_thread, NULL);
+    }
+
+    // take over socket and cache from a running proxy, or start afresh
+    if (handoff_path == NULL || handoff_take(handoff_path, &listenfd) < 0)
+        listenfd = Open_listenfd(argv[optind]);
     if (listenfd < 0)
-        printf("open_listenfd failed.\n");
+        log_msg("open_listenfd failed.\n");
     else{
-        while(1){
+        if (handoff_path != NULL)
+            handoff_listen(handoff_path, listenfd);
+        // returns only if io_uring fails or after a handoff
+        if (use_uring)
+            uring_accept_loop(listenfd, accept_conn, &handoff_done);
+        while(!handoff_done){
             clientlen = sizeof(clientaddr);
-            connfdp = Malloc(sizeof(int));
-            *connfdp = Accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
-            if (connfdp < 0){
-                printf("Accept failed.\n");
-                Free(connfdp);
-            }
-            else
-                Pthread_create(&tid, NULL, thread, connfdp);
+            if ((connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen)) >= 0)
+                accept_conn(connfd, (struct sockaddr *)&clientaddr);
+            else if (errno != EINTR)
+                log_msg("Accept failed.\n");
         }
     }
     close_wrapper(listenfd);
-    pthread_rwlock_destroy(&lock);
+
+    // the successor accepts now, finish the connections already accepted
+    if (handoff_done)
+        handoff_drain();
+    // the cache is left to exit: detached refresh, memwatch and revalidate
+    // threads may still be using it and its lock
+    log_deinit();
     return 0;
-}    
+}
 
 
 void *thread(void *vargp)
 {
-    int connfd = *((int *)vargp);
+    conn_t *conn = vargp;
+    int connfd = conn->fd;
+    long accepted = conn->accepted;
     Pthread_detach(pthread_self());
     Free(vargp);
-    doit(connfd);
+    doit(connfd, accepted);
     Close(connfd);
+    conn_done();
     return NULL;
 }
 
 
-void doit(int connfd)
+/*
+ * accept_conn - Admit a new connection and start a thread for it.
+ *               Connections are rejected before a thread is spent on them.
+ *               With -A, the thread is pinned where the connection arrived.
+ */
+void accept_conn(int connfd, struct sockaddr *addr)
 {
-    int n, serverfd;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char http_hdr[MAXLINE], request_hdr[MAXLINE], host_hdr[MAXLINE];
-    char hostname[MAXLINE], path[MAXLINE], portstr[MAXLINE];
+    conn_t *conn;
+    pthread_t tid;
+    pthread_attr_t attr;
 
-    int port = 80;
-    rio_t rio, server_rio;
+    if (!ratelimit_allow(addr))
+        reject(connfd, "429 Too Many Requests");
+    else if (!conn_admit())
+        reject(connfd, "503 Service Unavailable");
+    else{
+        conn = Malloc(sizeof(conn_t));
+        conn->fd = connfd;
+        conn->accepted = trace_now();
+        if (placement == AFFINITY_NONE){
+            Pthread_create(&tid, NULL, thread, conn);
+            return;
+        }
+        pthread_attr_init(&attr);
+        affinity_attr(&attr, connfd);
+        Pthread_create(&tid, &attr, thread, conn);
+        pthread_attr_destroy(&attr);
+    }
+}
 
+
+/*
+ * reject - Turn away a connection which was not admitted
+ */
+void reject(int connfd, char *status)
+{
+    char buf[MAXLINE];
+
+    sprintf(buf, "HTTP/1.0 %s\r\nRetry-After: 1\r\nContent-Length: 0\r\n%s\r\n", status, conn_hdr);
+    rio_writen(connfd, buf, strlen(buf));
+    close_wrapper(connfd);
+}
+
+
+void doit(int connfd, long accepted)
+{
+    char buf[MAXLINE];
+    request_t req;
+    rio_t rio;
+    struct timespec start;
+
+    trace_start(&req.trace, accepted);
+    trace_mark(&req.trace, "read request");
     Rio_readinitb(&rio,connfd);
-    Rio_readlineb(&rio,buf,MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    if (rio_readlineb(&rio,buf,MAXLINE) <= 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    req.method[0] = req.uri[0] = req.version[0] = '\0';
+    sscanf(buf, "%s %s %s", req.method, req.uri, req.version);
+    req.status = 0;
+    req.bytes = -1;
+    req.result = "-";
+
+    serve_request(connfd, &rio, &req);
+    log_request(connfd, &req, &start);
+    trace_finish(&req.trace, req.method, req.uri, req.status, req.result);
+}
+
+
+/*
+ * serve_request - Answer a request whose request line is in req.
+ *                 Status, bytes and cache result are left in req for the access log.
+ */
+void serve_request(int connfd, rio_t *rp, request_t *req)
+{
+    cache_obj *obj;
+    response_t resp;
+    ssize_t n;
+    time_t now;
+
+    read_requesthdrs(rp, req);
+    if(!strcasecmp(req->method, "CONNECT")){
+        do_connect(connfd, rp, req);
+        return;
+    }
+    if(strcasecmp(req->method, "GET")){
+        do_forward(connfd, rp, req);
+        return;
+    }
+
+    // serve from cache, stale copies only while they are refreshed or the origin fails
+    trace_mark(&req->trace, "cache lookup");
+    if (cachekey_make(req->uri, req->key) < 0)
+        strcpy(req->key, req->uri);
+    if ((obj = lookup_variant(req)) != NULL){
+        now = time(NULL);
+        if (obj->pinned || !obj->expires || obj->expires > now){
+            req->result = "HIT";
+            serve_cached(connfd, req, obj, 0);
+        }
+        else if (now < obj->expires + obj->stale_revalidate){
+            req->result = "STALE";
+            revalidate(req, obj);
+            serve_cached(connfd, req, obj, 1);
+        }
+        else
+            serve_stale_if_error(connfd, req, obj);
+        cache_release(obj);
+        return;
+    }
+
+    if (req->range[0] && !req->if_range){
+        serve_range_miss(connfd, req);
+        return;
+    }
+
+    resp.buf = Malloc(MAXBUF);
+    resp.cap = MAXBUF;
+    resp.trace = &req->trace;
+    req->result = "MISS";
+    if ((n = fetch_object(req, req->vary_hdrs, connfd, &resp)) == -2)
+        send_error(connfd, req, 502, "Bad Gateway");
+    else if (n < 0)
+        log_msg("Fetching %s failed.\n", req->uri);
+    else{
+        req->status = resp.status;
+        req->bytes = n - resp.hdr_size;
+        if (resp.cacheable)
+            cache_response(req->key, req->vary_hdrs, &resp, 0);
+    }
+    Free(resp.buf);
+}
+
+
+/*
+ * log_request - Write the access log record of a request:
+ *               client [time] "request line" status bytes result latency
+ */
+void log_request(int connfd, request_t *req, struct timespec *start)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char client[NI_MAXHOST] = "-", date[64], bytes[32];
+    struct timespec end;
+    struct tm tm;
+    time_t now = time(NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (getpeername(connfd, (struct sockaddr *)&addr, &len) == 0)
+        getnameinfo((struct sockaddr *)&addr, len, client, sizeof(client), NULL, 0, NI_NUMERICHOST);
+    gmtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    if (req->bytes >= 0)
+        sprintf(bytes, "%zd", req->bytes);
+    else
+        strcpy(bytes, "-");
+    log_access("%s [%s] \"%s %s %s\" %d %s %s %ldus\n", client, date, req->method, req->uri, req->version,
+               req->status, bytes, req->result,
+               (end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000);
+}
+
+
+/*
+ * read_requesthdrs - Read request headers from client up to the blank line
+ *                    and keep the ones the proxy acts on in req.
+ *                    End-to-end headers are kept in req->hdrs for do_forward(),
+ *                    content negotiation headers in req->vary_hdrs for GET.
+ *                    Accept-Encoding is passed on as "gzip" or not at all,
+ *                    so responses varying on it have two variants at most.
+ */
+void read_requesthdrs(rio_t *rp, request_t *req)
+{
+    char buf[MAXLINE];
+    size_t n;
+
+    req->accept_gzip = 0;
+    req->vary_hdrs[0] = '\0';
+    req->range[0] = '\0';
+    req->if_range = 0;
+    req->from_peer = 0;
+    req->hdrs_len = 0;
+    req->content_length = -1;
+    req->chunked = 0;
+    req->expect_continue = 0;
+    while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n")){
+        if (!strncasecmp(buf, "Content-Length:", 15)){
+            req->content_length = atol(buf + 15);
+            continue;
+        }
+        else if (!strncasecmp(buf, "Transfer-Encoding:", 18)){
+            req->chunked = (http_has_token(buf + 18, "chunked"));
+            continue;
+        }
+        else if (!strncasecmp(buf, "Expect:", 7)){
+            req->expect_continue = (http_has_token(buf + 7, "100-continue"));
+            continue;
+        }
+        else if (!strncasecmp(buf, "Host:", 5) || !strncasecmp(buf, "User-Agent:", 11)
+                 || !strncasecmp(buf, "Connection:", 11) || !strncasecmp(buf, "Proxy-Connection:", 17)
+                 || !strncasecmp(buf, "Keep-Alive:", 11) || !strncasecmp(buf, "TE:", 3)
+                 || !strncasecmp(buf, "Upgrade:", 8))
+            continue;   /* written by the proxy or hop-by-hop */
+        else if (!strncasecmp(buf, "Range:", 6))
+            strcpy(req->range, buf + 6);
+        else if (!strncasecmp(buf, "If-Range:", 9))
+            req->if_range = 1;
+        else if (!strncasecmp(buf, "X-Proxy-Peer:", 13))
+            req->from_peer = 1;
+        else if (!strncasecmp(buf, "Accept-Encoding:", 16))
+            /* "gzip;q=0" means gzip is not acceptable */
+            req->accept_gzip = http_token_q(buf + 16, "gzip") > 0;
+        else if ((!strncasecmp(buf, "Accept:", 7) || !strncasecmp(buf, "Accept-Language:", 16))
+                 && strlen(req->vary_hdrs) + n < MAXLINE - 32)
+            strcat(req->vary_hdrs, buf);
+
+        if (req->hdrs_len + n < MAXBUF){
+            memcpy(req->hdrs + req->hdrs_len, buf, n);
+            req->hdrs_len += n;
+        }
+    }
+    req->hdrs[req->hdrs_len] = '\0';
+    if (req->accept_gzip)
+        strcat(req->vary_hdrs, gzip_hdr);
+}
+
+
+/*
+ * serve_range_miss - Range request for an object which is not cached.
+ *                    The whole object is fetched and cached, then the range is cut out of it.
+ *                    Objects too large for the cache are asked from the origin with the Range header.
+ *                    Objects owned by a peer are asked from the peer with the Range header,
+ *                    which caches the whole object and answers with the range.
+ */
+void serve_range_miss(int connfd, request_t *req)
+{
+    char range_hdr[2*MAXLINE + 8];
+    cache_obj *obj;
+    response_t resp;
+
+    ssize_t n;
+
+    resp.buf = Malloc(MAXBUF);
+    resp.cap = MAXBUF;
+    resp.trace = &req->trace;
+    req->result = "MISS";
+    if ((req->from_peer || peer_owner(req->key) == NULL)
+        && fetch_uri(req->uri, req->vary_hdrs, NULL, -1, &resp) >= 0 && resp.cacheable){
+        cache_response(req->key, req->vary_hdrs, &resp, 0);
+        if ((obj = lookup_variant(req)) != NULL){
+            serve_cached(connfd, req, obj, 0);
+            cache_release(obj);
+            Free(resp.buf);
+            return;
+        }
+    }
+
+    sprintf(range_hdr, "%sRange:%s", req->vary_hdrs, req->range);
+    if ((n = fetch_object(req, range_hdr, connfd, &resp)) == -2)
+        send_error(connfd, req, 502, "Bad Gateway");
+    else if (n < 0)
+        log_msg("Fetching %s failed.\n", req->uri);
+    else{
+        req->status = resp.status;
+        req->bytes = n - resp.hdr_size;
+    }
+    Free(resp.buf);
+}
+
+
+/*
+ * serve_cached - Answer req from obj, with the range the client asked for if there is one.
+ *                Negative entries (cached errors) are always sent whole.
+ */
+void serve_cached(int connfd, request_t *req, cache_obj *obj, int stale)
+{
+    trace_mark(&req->trace, "send cached");
+    if (obj->status == 200 && req->range[0] && !req->if_range
+        && serve_range(connfd, obj, req->range, stale ? stale_warning : "", &req->status) <= 0)
+        return;
+    req->status = obj->status;
+    req->bytes = (obj->gzipped && !req->accept_gzip) ? obj->raw_size : obj->size - obj->hdr_size;
+    serve_obj(connfd, obj, req->accept_gzip, stale);
+}
+
+
+/*
+ * serve_stale_if_error - Answer req for an object past its stale-while-revalidate window.
+ *                        The object is fetched again, and the stale copy is only served
+ *                        if the origin can not be reached or answers with a server error.
+ *                        The response is read whole before anything is sent to the client.
+ */
+void serve_stale_if_error(int connfd, request_t *req, cache_obj *stale)
+{
+    response_t resp;
+    cache_obj *obj;
+    ssize_t n;
+
+    resp.buf = Malloc(MAXBUF);
+    resp.cap = MAXBUF;
+    resp.trace = &req->trace;
+    req->result = "MISS";
+    n = fetch_uri(req->uri, req->vary_hdrs, NULL, -1, &resp);
+    if (n < 0 || resp.status >= 500){
+        req->result = "STALE";
+        serve_cached(connfd, req, stale, 1);
+    }
+    else if (resp.cacheable && cache_response(req->key, req->vary_hdrs, &resp, 0) == 0
+             && (obj = lookup_variant(req)) != NULL){
+        serve_cached(connfd, req, obj, 0);
+        cache_release(obj);
+    }
+    else if (resp.whole){
+        req->status = resp.status;
+        req->bytes = n - resp.hdr_size;
+        rio_writen(connfd, resp.buf, n);
+    }
+    else if ((n = fetch_uri(req->uri, req->vary_hdrs, NULL, connfd, &resp)) == -2){
+        /* too large to read whole, and the origin went away meanwhile */
+        req->result = "STALE";
+        serve_cached(connfd, req, stale, 1);
+    }
+    else if (n >= 0){
+        req->status = resp.status;
+        req->bytes = n - resp.hdr_size;
+    }
+    Free(resp.buf);
+}
+
+
+/*
+ * lookup_variant - Find the object cached for req. If its key holds a Vary marker,
+ *                  the variant selected by the negotiation headers of req is looked up.
+ *                  Stale objects are returned as by cache_lookup_stale().
+ */
+cache_obj *lookup_variant(request_t *req)
+{
+    char variant[MAXLINE];
+    cache_obj *obj;
+    int n;
+
+    if ((obj = cache_lookup_stale(req->key)) == NULL || !obj->vary)
+        return obj;
+    n = cachekey_variant(req->key, obj->data, req->vary_hdrs, variant);
+    cache_release(obj);
+    return (n < 0) ? NULL : cache_lookup_stale(variant);
+}
+
+
+/*
+ * revalidate - Refresh a stale object in the background unless a refresh is running.
+ *              It is fetched again with the negotiation headers of req, which selected it.
+ */
+void revalidate(request_t *req, cache_obj *obj)
+{
+    pthread_t tid;
+    refresh_t *rf;
+
+    if (!cache_claim_refresh(obj))
+        return;
+    rf = Malloc(sizeof(refresh_t));
+    rf->obj = obj;
+    strcpy(rf->uri, req->uri);
+    strcpy(rf->key, req->key);
+    strcpy(rf->vary_hdrs, req->vary_hdrs);
+    Pthread_create(&tid, NULL, revalidate_thread, rf);
+}
+
+
+void *revalidate_thread(void *vargp)
+{
+    refresh_t *rf = vargp;
+    response_t resp;
+
+    Pthread_detach(pthread_self());
+    resp.buf = Malloc(MAXBUF);
+    resp.cap = MAXBUF;
+    resp.trace = NULL;
+    /* An error keeps the stale object as it is, so stale-if-error still applies */
+    if (fetch_uri(rf->uri, rf->vary_hdrs, NULL, -1, &resp) >= 0 && resp.cacheable && resp.status == 200)
+        cache_response(rf->key, rf->vary_hdrs, &resp, 0);
+    else
+        log_msg("Refreshing %s failed.\n", rf->uri);
+    Free(resp.buf);
+    __atomic_store_n(&rf->obj->refreshing, 0, __ATOMIC_RELEASE);
+    cache_release(rf->obj);
+    Free(rf);
+    return NULL;
+}
+
+
+/*
+ * send_error - Answer with an empty error response
+ */
+void send_error(int connfd, request_t *req, int status, char *reason)
+{
+    char buf[MAXLINE];
+
+    sprintf(buf, "HTTP/1.0 %d %s\r\nContent-Length: 0\r\n%s\r\n", status, reason, conn_hdr);
+    rio_writen(connfd, buf, strlen(buf));
+    req->status = status;
+    req->bytes = 0;
+}
+
+
+/*
+ * negative_status - Error statuses which are cached for a short time
+ */
+int negative_status(int status)
+{
+    return status == 404 || status == 410 || status == 500 || status == 502 || status == 503 || status == 504;
+}
+
+
+/*
+ * do_connect - Open a tunnel to the host:port in req->uri and relay bytes both ways.
+ *              Only ports in connect_ports are allowed, others are answered with 403,
+ *              so the proxy is not a relay to any TCP service.
+ */
+void do_connect(int connfd, rio_t *rp, request_t *req)
+{
+    char hostname[MAXLINE], *portstr;
+    char *established = "HTTP/1.0 200 Connection Established\r\n\r\n";
+    char *bad_gateway = "HTTP/1.0 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    int serverfd, port, i;
+
+    req->result = "TUNNEL";
+    req->status = 502;
+
+    strcpy(hostname, req->uri);
+    if ((portstr = strrchr(hostname, ':')) == NULL){
+        rio_writen(connfd, bad_gateway, strlen(bad_gateway));
+        return;
+    }
+    *portstr++ = '\0';
+    port = atoi(portstr);
+    for (i = 0; i < nconnect_ports && connect_ports[i] != port; i++)
+        ;
+    if (i == nconnect_ports){
+        send_error(connfd, req, 403, "Forbidden");
+        return;
+    }
+    if ((serverfd = origin_connect(hostname, port, &req->trace)) < 0){
+        rio_writen(connfd, bad_gateway, strlen(bad_gateway));
+        return;
+    }
+
+    /* Bytes the client sent after the headers are already in rp's buffer */
+    if (rio_writen(connfd, established, strlen(established)) < 0
+        || (rp->rio_cnt > 0 && rio_writen(serverfd, rp->rio_bufptr, rp->rio_cnt) < 0)){
+        close_wrapper(serverfd);
+        return;
+    }
+    req->status = 200;
+    trace_mark(&req->trace, "tunnel");
+    tunnel_relay(connfd, serverfd);
+    close_wrapper(serverfd);
+}
+
+
+/*
+ * do_forward - Forward a request other than GET to the origin server and relay the response.
+ *              The request body (Content-Length or chunked) is streamed to the origin as
+ *              it arrives, so bodies of any size pass in constant memory. A chunked body
+ *              needs an HTTP/1.1 request; the response is then de-chunked for HTTP/1.0 clients.
+ *              These responses are never cached.
+ */
+void do_forward(int connfd, rio_t *rp, request_t *req)
+{
+    char *bad_gateway = "HTTP/1.0 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    char *bad_request = "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    char *go_on = "HTTP/1.1 100 Continue\r\n\r\n";
+    char hostname[MAXLINE], path[MAXLINE], *http_hdr;
+    int serverfd, port = 80;
+    ssize_t n;
+    rio_t server_rio;
 
-    if(strcasecmp(method, "GET")){
-        printf("Proxy does not implement this method");
+    req->result = "PASS";
+
+    if (parse_uri(req->uri, hostname, path, &port) < 0){
+        req->status = 400;
+        rio_writen(connfd, bad_request, strlen(bad_request));
+        return;
+    }
+    if ((serverfd = origin_connect(hostname, port, &req->trace)) < 0){
+        req->status = 502;
+        rio_writen(connfd, bad_gateway, strlen(bad_gateway));
+        return;
+    }
+
+    trace_mark(&req->trace, "send request");
+    http_hdr = Malloc(MAXBUF + 3*MAXLINE);
+    sprintf(http_hdr, "%s %s HTTP/1.%d\r\nHost: %s\r\n%s%s%s%s",
+            req->method, path, req->chunked, hostname, conn_hdr, prox_hdr, user_agent_hdr, req->hdrs);
+    if (req->chunked)
+        strcat(http_hdr, "Transfer-Encoding: chunked\r\n");
+    else if (req->content_length >= 0)
+        sprintf(http_hdr + strlen(http_hdr), "Content-Length: %ld\r\n", req->content_length);
+    strcat(http_hdr, "\r\n");
+    n = rio_writen(serverfd, http_hdr, strlen(http_hdr));
+    Free(http_hdr);
+
+    /* The origin gets the body right away, so the client is told to go on by the proxy */
+    if (n >= 0 && req->expect_continue && !strcasecmp(req->version, "HTTP/1.1"))
+        n = rio_writen(connfd, go_on, strlen(go_on));
+
+    /* Request body */
+    if (n >= 0 && req->chunked)
+        n = http_relay_chunked(rp, serverfd, 0);
+    else if (n >= 0 && req->content_length > 0)
+        n = http_relay_length(rp, serverfd, req->content_length);
+    if (n < 0){
+        log_msg("Forwarding %s %s failed.\n", req->method, req->uri);
+        close_wrapper(serverfd);
         return;
     }
- 
-    parse_uri(uri, hostname, path, &port);
-    sprintf(request_hdr, "GET %s HTTP/1.0\r\n", path);
-    sprintf(host_hdr, "Host: %s\r\n", hostname);
-    sprintf(http_hdr, "%s%s%s%s%s%s", request_hdr, host_hdr, conn_hdr, prox_hdr, user_agent_hdr, "\r\n");
 
-    sprintf(portstr, "%d", port);
-    serverfd = Open_clientfd(hostname, portstr);
+    trace_mark(&req->trace, "origin wait");
+    Rio_readinitb(&server_rio, serverfd);
+    if ((req->bytes = relay_response(&server_rio, connfd, !strcasecmp(req->version, "HTTP/1.0"),
+                                     &req->status, &req->trace)) < 0)
+        log_msg("Forwarding %s %s failed.\n", req->method, req->uri);
+    close_wrapper(serverfd);
+}
+
+
+/*
+ * relay_response - Relay a response to connfd until the server closes the connection.
+ *                  A chunked body is decoded for HTTP/1.0 clients and relayed as it is otherwise.
+ *                  Interim 1xx responses are not relayed to HTTP/1.0 clients.
+ *                  Sets *status to the final status. Returns the body size, -1 on error.
+ *                  The relay phase of t starts at the first byte of the response.
+ */
+ssize_t relay_response(rio_t *rp, int connfd, int client_v10, int *status, trace_t *t)
+{
+    char buf[MAXLINE];
+    int chunked = 0, first = 1;
+    ssize_t n;
+
+    *status = 0;
+    while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0){
+        if (first && *status == 0)
+            trace_mark(t, "relay");
+        if (first){
+            sscanf(buf, "%*s %d", status);
+            chunked = 0;
+            first = 0;
+        }
+        else if (!strncasecmp(buf, "Transfer-Encoding:", 18) && http_has_token(buf + 18, "chunked")){
+            chunked = 1;
+            if (client_v10)
+                continue;
+        }
+        if (!(client_v10 && *status / 100 == 1) && rio_writen(connfd, buf, n) < 0)
+            return -1;
+        if (!strcmp(buf, "\r\n")){
+            if (*status / 100 != 1)
+                break;
+            first = 1;  /* final response follows */
+        }
+    }
+    if (n <= 0)
+        return -1;
+
+    if (chunked && client_v10)
+        return http_relay_chunked(rp, connfd, 1);
+    return http_relay_eof(rp, connfd);
+}
+
+
+/*
+ * fetch_object - Fetch req->uri from the peer which owns it in the cluster,
+ *                or from the origin server if this proxy owns it, the request
+ *                came from a peer, or the owner can not be reached.
+ */
+ssize_t fetch_object(request_t *req, char *extra_hdrs, int connfd, response_t *resp)
+{
+    peer_t *peer;
+    ssize_t n;
+
+    if (!req->from_peer && (peer = peer_owner(req->key)) != NULL){
+        if ((n = fetch_uri(req->uri, extra_hdrs, peer, connfd, resp)) != -2){
+            req->result = "PEER";
+            return n;
+        }
+        log_msg("Peer %s:%s is unreachable.\n", peer->host, peer->port);
+        peer_failed(peer);
+    }
+    return fetch_uri(req->uri, extra_hdrs, NULL, connfd, resp);
+}
+
+
+/*
+ * fetch_uri - Send GET request for uri to the origin server and read the response.
+ *             With peer, the request is sent to that peer proxy instead.
+ *             extra_hdrs are added to the request headers.
+ *             The response is relayed to connfd as it arrives (connfd < 0 : no client)
+ *             and copied to resp->buf as long as it fits in cache_max_object.
+ *             Without a client, reading stops once the response does not fit.
+ *             Returns the response size, -1 on error, or -2 if the server could
+ *             not be reached (nothing was sent to connfd).
+ */
+ssize_t fetch_uri(char *uri, char *extra_hdrs, peer_t *peer, int connfd, response_t *resp)
+{
+    int serverfd, secs, chunked = 0, ended = 0;
+    ssize_t n;
+    char buf[MAXLINE], http_hdr[5*MAXLINE];
+    char hostname[MAXLINE], path[MAXLINE];
+    char *p;
+    int port = 80;
+    rio_t server_rio;
+    fetch_state st;
+
+    resp->size = resp->hdr_size = 0;
+    resp->status = 0;
+    resp->whole = 0;
+    resp->cacheable = 0;
+    resp->expires = 0;
+    resp->stale_revalidate = resp->stale_error = -1;
+    st.resp = resp;
+    st.objsize = 0;
+    st.total = 0;
+
+    if (parse_uri(uri, hostname, path, &port) < 0)
+        return -1;
+    if (peer != NULL){
+        /* Same URI as the client sent, so the owner caches it under the same key */
+        snprintf(http_hdr, sizeof(http_hdr), "GET %s%s HTTP/1.0\r\nHost: %s\r\nX-Proxy-Peer: 1\r\n%s%s%s%s\r\n",
+                 strncasecmp(uri, "http://", 7) ? "http://" : "", uri, hostname,
+                 conn_hdr, prox_hdr, user_agent_hdr, extra_hdrs);
+        trace_mark(resp->trace, "connect peer");
+        serverfd = open_clientfd(peer->host, peer->port);
+    }
+    else{
+        snprintf(http_hdr, sizeof(http_hdr), "GET %s HTTP/1.0\r\nHost: %s\r\n%s%s%s%s\r\n",
+                 path, hostname, conn_hdr, prox_hdr, user_agent_hdr, extra_hdrs);
+        /* An origin which just failed is not waited for again */
+        serverfd = origin_connect(hostname, port, resp->trace);
+    }
+    if (serverfd < 0)
+        return -2;
 
     Rio_readinitb(&server_rio,serverfd);
-    Rio_writen(serverfd, http_hdr, strlen(http_hdr));
-    while((n = Rio_readlineb(&server_rio, buf, MAXLINE))!=0)
-        Rio_writen(connfd,buf,n);
-    Close(serverfd);
+    if (rio_writen(serverfd, http_hdr, strlen(http_hdr)) < 0){
+        close_wrapper(serverfd);
+        return -2;
+    }
+    trace_mark(resp->trace, "origin wait");
+
+    /* Status line and response headers */
+    while ((n = rio_readlineb(&server_rio, buf, MAXLINE)) > 0){
+        if (st.total == 0){
+            trace_mark(resp->trace, "relay");
+            sscanf(buf, "%*s %d", &resp->status);
+        }
+        else if (!strncasecmp(buf, "Cache-Control:", 14)){
+            if ((p = strstr(buf, "max-age=")) != NULL && sscanf(p + 8, "%d", &secs) == 1)
+                resp->expires = time(NULL) + secs;
+            if ((p = strstr(buf, "stale-while-revalidate=")) != NULL && sscanf(p + 23, "%d", &secs) == 1)
+                resp->stale_revalidate = secs;
+            if ((p = strstr(buf, "stale-if-error=")) != NULL && sscanf(p + 15, "%d", &secs) == 1)
+                resp->stale_error = secs;
+        }
+        else if (!strncasecmp(buf, "Transfer-Encoding:", 18))
+            chunked = 1;
+        if (connfd >= 0 && rio_writen(connfd, buf, n) < 0)
+            break;
+        keep_chunk(buf, n, &st);
+        if (!strcmp(buf, "\r\n")){
+            ended = 1;
+            break;
+        }
+    }
+    resp->hdr_size = st.total;
+    if (st.total == 0){     /* closed without a response */
+        close_wrapper(serverfd);
+        if (peer == NULL)
+            origin_failed(hostname, port);
+        return -2;
+    }
+
+    /* Response body */
+    if (n > 0){
+        if (!use_uring || connfd < 0 || (n = relay_body_uring(&server_rio, connfd, &st)) == -2)
+            n = relay_body(&server_rio, connfd, &st);
+    }
+    close_wrapper(serverfd);
+
+    if (n < 0)
+        return -1;
+    resp->size = st.total;
+    resp->whole = (st.objsize == st.total);
+    /* serve_obj() frames cached bodies with Content-Length, so chunked ones are not kept,
+       nor responses cut off before the blank line */
+    resp->cacheable = (peer == NULL && (resp->status == 200 || negative_status(resp->status))
+                       && ended && !chunked && resp->whole);
+    return st.total;
 }
 
 
+/*
+ * relay_body - Read the response body with read() and relay it with write().
+ *              Without a client, reading stops once the response can not be cached.
+ *              Returns 0 at EOF, -1 on error.
+ */
+ssize_t relay_body(rio_t *rp, int connfd, fetch_state *st)
+{
+    char buf[MAXBUF];
+    ssize_t n;
+
+    while ((n = rio_readnb(rp, buf, MAXBUF)) > 0){
+        if (connfd >= 0 && rio_writen(connfd, buf, n) < 0)
+            return -1;
+        keep_chunk(buf, n, st);
+        if (connfd < 0 && st->objsize < st->total)
+            break;
+    }
+    return n;
+}
+
+
+/*
+ * relay_body_uring - Relay the response body to connfd through io_uring.
+ *                    Returns 0 at EOF, -1 on error, or -2 if no ring is available,
+ *                    in which case relay_body() carries on where it stopped.
+ */
+ssize_t relay_body_uring(rio_t *rp, int connfd, fetch_state *st)
+{
+    ssize_t n;
+
+    /* Body bytes read along with the headers are still in rp */
+    if (rp->rio_cnt > 0){
+        if (rio_writen(connfd, rp->rio_bufptr, rp->rio_cnt) < 0)
+            return -1;
+        keep_chunk(rp->rio_bufptr, rp->rio_cnt, st);
+        rp->rio_cnt = 0;
+    }
+    if ((n = uring_relay(rp->rio_fd, connfd, keep_chunk, st)) < 0)
+        return n;
+    return 0;
+}
+
+
+/*
+ * keep_chunk - Account for a chunk of the response and copy it to resp->buf,
+ *              which is doubled as needed up to cache_max_object.
+ *              Once a chunk did not fit, nothing more is copied.
+ */
+int keep_chunk(char *buf, size_t n, void *arg)
+{
+    fetch_state *st = arg;
+    response_t *resp = st->resp;
+
+    st->total += n;
+    if (st->objsize + n > cache_max_object || st->objsize + n < st->total)
+        return 0;
+    if (st->objsize + n > resp->cap){
+        while (st->objsize + n > resp->cap)
+            resp->cap *= 2;
+        if (resp->cap > cache_max_object)
+            resp->cap = cache_max_object;
+        resp->buf = Realloc(resp->buf, resp->cap);
+    }
+    memcpy(resp->buf + st->objsize, buf, n);
+    st->objsize += n;
+    return 0;
+}
+
+
+/*
+ * cache_response - Make a cache object for key from a complete response and insert it.
+ *                  Framing headers are dropped since serve_obj() writes its own.
+ *                  With -z, compressible bodies are stored gzip-encoded.
+ *                  A response with Vary is cached as the variant selected by vary_hdrs,
+ *                  the negotiation headers it was fetched with, and key gets a Vary marker.
+ *                  An origin encoded body varies on Accept-Encoding even without Vary.
+ */
+int cache_response(char *key, char *vary_hdrs, response_t *resp, int pinned)
+{
+    char *hdr, *line, *end, *eol, *body, *zbody = NULL;
+    char vary[MAXLINE] = "", variant[MAXLINE];
+    size_t hdr_size = 0, body_size, len;
+    ssize_t zsize;
+    int compressible = 0, encoded = 0;
+    cache_obj *obj, *marker;
+
+    hdr = Malloc(resp->hdr_size);
+    end = resp->buf + resp->hdr_size - 2;   /* blank line */
+    for (line = resp->buf; line < end; line += len){
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            break;
+        len = eol - line + 1;
+        if (!strncasecmp(line, "Content-Length:", 15) || !strncasecmp(line, "Connection:", 11)
+            || !strncasecmp(line, "Proxy-Connection:", 17) || !strncasecmp(line, "Keep-Alive:", 11))
+            continue;
+        if (!strncasecmp(line, "Content-Type:", 13))
+            compressible = gzip_compressible(line + 13);
+        else if (!strncasecmp(line, "Content-Encoding:", 17) || !strncasecmp(line, "Transfer-Encoding:", 18))
+            encoded = 1;
+        else if (!strncasecmp(line, "Vary:", 5) && cachekey_vary(line + 5, vary, sizeof(vary)) < 0){
+            Free(hdr);      /* Vary: * */
+            return -1;
+        }
+        memcpy(hdr + hdr_size, line, len);
+        hdr_size += len;
+    }
+    if ((encoded && cachekey_vary("accept-encoding", vary, sizeof(vary)) < 0)
+        || (vary[0] && cachekey_variant(key, vary, vary_hdrs, variant) < 0)){
+        Free(hdr);
+        return -1;
+    }
+    if (vary[0]){
+        marker = cache_new(key, vary, strlen(vary) + 1, "", 0);
+        marker->vary = 1;
+        marker->pinned = pinned;
+        if (cache_insert(marker) < 0){
+            Free(hdr);
+            return -1;
+        }
+        key = variant;
+    }
+
+    body = resp->buf + resp->hdr_size;
+    body_size = resp->size - resp->hdr_size;
+    if (compress_cache && compressible && !encoded && body_size > 0){
+        zbody = Malloc(body_size);
+        if ((zsize = gzip_encode(body, body_size, zbody, body_size)) < 0){
+            Free(zbody);    /* does not get smaller */
+            zbody = NULL;
+        }
+    }
+
+    if (zbody != NULL){
+        obj = cache_new(key, hdr, hdr_size, zbody, zsize);
+        obj->raw_size = body_size;
+        obj->gzipped = 1;
+        Free(zbody);
+    }
+    else
+        obj = cache_new(key, hdr, hdr_size, body, body_size);
+    Free(hdr);
+    obj->expires = resp->expires;
+    obj->status = resp->status;
+    if (resp->status != 200){
+        /* negative entry: kept briefly, never served stale */
+        if (!obj->expires)
+            obj->expires = time(NULL) + NEGATIVE_TTL;
+    }
+    else{
+        obj->stale_revalidate = (resp->stale_revalidate >= 0) ? resp->stale_revalidate : STALE_REVALIDATE;
+        obj->stale_error = (resp->stale_error >= 0) ? resp->stale_error : STALE_IF_ERROR;
+    }
+    obj->pinned = pinned;
+    return cache_insert(obj);
+}
+
+
+/*
+ * serve_obj - Send cached object to client.
+ *             A gzip-encoded body is inflated for clients which do not accept gzip.
+ *             A stale object is marked with a Warning header.
+ *             Ranges are only offered for 200 entries, and headers the origin
+ *             already sent are not added again.
+ */
+int serve_obj(int connfd, cache_obj *obj, int accept_gzip, int stale)
+{
+    char hdr[MAXLINE];
+    char *body = obj->data + obj->hdr_size;
+    size_t body_size = obj->size - obj->hdr_size;
+    int inflate = obj->gzipped && !accept_gzip, len = 0;
+
+    if (rio_writen(connfd, obj->data, obj->hdr_size) < 0
+        || (stale && rio_writen(connfd, stale_warning, strlen(stale_warning)) < 0))
+        return -1;
+
+    if (obj->gzipped && !inflate)
+        len += sprintf(hdr + len, "Content-Encoding: gzip\r\n");
+    if (obj->gzipped && !has_header(obj, "Vary"))
+        len += sprintf(hdr + len, "Vary: Accept-Encoding\r\n");
+    if (obj->status == 200 && !has_header(obj, "Accept-Ranges"))
+        len += sprintf(hdr + len, "Accept-Ranges: bytes\r\n");
+    sprintf(hdr + len, "Content-Length: %zu\r\n%s\r\n", inflate ? obj->raw_size : body_size, conn_hdr);
+    if (rio_writen(connfd, hdr, strlen(hdr)) < 0)
+        return -1;
+
+    if (inflate)
+        return (gzip_decode_writen(connfd, body, body_size) < 0) ? -1 : 0;
+    return (rio_writen(connfd, body, body_size) < 0) ? -1 : 0;
+}
+
+
+/*
+ * has_header - Whether the stored headers of obj include header name
+ */
+int has_header(cache_obj *obj, char *name)
+{
+    size_t n = strlen(name);
+    char *line, *eol, *end = obj->data + obj->hdr_size;
+
+    for (line = obj->data; line < end; line = eol + 1){
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            eol = end;
+        if (eol - line > n && !strncasecmp(line, name, n) && line[n] == ':')
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * parse_uri - Split uri into hostname, path and port (left unchanged if uri has no port)
+ */
 int parse_uri(char *uri, char *hostname, char *path, int *port)
 {
     char *host_start = uri + 7;
     char *port_start, *path_start;
+    size_t len;
 
-    if (strncmp(uri, "http://", 7) != 0)
+    if (strncasecmp(uri, "http://", 7) != 0)
         host_start = uri;
 
-    port_start = strstr(host_start, ":");
+    path_start = strchr(host_start, '/');
+    len = (path_start != NULL) ? path_start - host_start : strlen(host_start);
+    if (len == 0 || len >= MAXLINE)
+        return -1;
+    memcpy(hostname, host_start, len);
+    hostname[len] = '\0';
+    strcpy(path, (path_start != NULL) ? path_start : "/");
+
+    port_start = strchr(hostname, ':');
     if (port_start != NULL){
         *port_start = '\0';
-        sscanf(host_start, "%s", hostname);
-        sscanf(port_start+1, "%d%s", port, path);
+        *port = atoi(port_start + 1);
     }
-    else{
-        path_start = strstr(host_start, "/");
-        if (path_start != NULL){
-            path = path_start;
-            *path_start = '\0';
-            hostname = host_start;
-        }
-        else{
-            hostname = host_start;
-            *path = '\0';
+    return 0;
+}
+
+
+/*
+ * parse_size - Parse a size such as 4096, 512K, 64M or 2G. Returns 0 if s is malformed.
+ */
+size_t parse_size(char *s)
+{
+    char *end;
+    double n = strtod(s, &end);
+
+    if (end == s || n <= 0)
+        return 0;
+    switch (*end){
+    case 'G': case 'g': n *= 1024;
+    case 'M': case 'm': n *= 1024;
+    case 'K': case 'k': n *= 1024;
+    case '\0':
+        break;
+    default:
+        return 0;
+    }
+    return n;
+}
+
+
+/*
+ * parse_ports - Set connect_ports from a comma separated list of ports.
+ *               Returns -1 if a port is malformed or there are too many.
+ */
+int parse_ports(char *list)
+{
+    char *p = list, *end;
+    long port;
+    int n = 0;
+
+    do {
+        port = strtol(p, &end, 10);
+        if (end == p || port <= 0 || port > 65535 || (*end != ',' && *end != '\0') || n == MAX_CONNECT_PORTS)
+            return -1;
+        connect_ports[n++] = port;
+        p = end + 1;
+    } while (*end == ',');
+    nconnect_ports = n;
+    return 0;
+}
+
+
+/*
+ * load_prefetch - Read the prefetch list from filename.
+ *                 One URI per line, optionally followed by its refresh interval in seconds.
+ *                 Empty lines and lines starting with '#' are ignored.
+ */
+int load_prefetch(char *filename)
+{
+    FILE *fp;
+    char line[MAXLINE], uri[MAXLINE];
+    prefetch_t *entry;
+    int ttl;
+
+    if ((fp = fopen(filename, "r")) == NULL){
+        fprintf(stderr, "Cannot open prefetch list %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, MAXLINE, fp) != NULL){
+        if (sscanf(line, "%s", uri) != 1 || uri[0] == '#')
+            continue;
+        if (sscanf(line, "%*s %d", &ttl) != 1 || ttl <= 0)
+            ttl = DEFAULT_PIN_TTL;
+        entry = Malloc(sizeof(prefetch_t));
+        strcpy(entry->uri, uri);
+        if (cachekey_make(uri, entry->key) < 0)
+            strcpy(entry->key, uri);
+        entry->ttl = ttl;
+        entry->next_refresh = 0;
+        entry->next = prefetch_list;
+        prefetch_list = entry;
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+/*
+ * refresh_thread - Fetch every object in the prefetch list and pin it in the cache.
+ *                  The pinned copy is fetched again when it expires,
+ *                  so clients never wait for the origin for these objects.
+ *                  If the object varies on Accept-Encoding, the variant for
+ *                  gzip clients is pinned too.
+ */
+void *refresh_thread(void *vargp)
+{
+    prefetch_t *entry;
+    response_t resp;
+    cache_obj *marker;
+    time_t now;
+    int gzip_variant;
+
+    Pthread_detach(pthread_self());
+    resp.buf = Malloc(MAXBUF);
+    resp.cap = MAXBUF;
+    resp.trace = NULL;
+    while (1){
+        for (entry = prefetch_list; entry != NULL; entry = entry->next){
+            now = time(NULL);
+            if (entry->next_refresh > now)
+                continue;
+            if (prefetch(entry, "", &resp) < 0){
+                entry->next_refresh = now + PREFETCH_RETRY;
+                continue;
+            }
+            entry->next_refresh = resp.expires;
+
+            gzip_variant = 0;
+            if ((marker = cache_lookup_stale(entry->key)) != NULL){
+                gzip_variant = marker->vary && strstr(marker->data, "accept-encoding") != NULL;
+                cache_release(marker);
+            }
+            if (gzip_variant && prefetch(entry, gzip_hdr, &resp) < 0)
+                entry->next_refresh = now + PREFETCH_RETRY;
         }
+        Sleep(1);
     }
+    return NULL;
+}
+
+
+/*
+ * prefetch - Fetch entry->uri with the negotiation headers vary_hdrs and pin the response.
+ *            resp->expires is when it has to be fetched again.
+ *            Returns -1 if the fetch failed.
+ */
+int prefetch(prefetch_t *entry, char *vary_hdrs, response_t *resp)
+{
+    time_t now = time(NULL);
+
+    if (fetch_uri(entry->uri, vary_hdrs, NULL, -1, resp) < 0 || !resp->cacheable || resp->status != 200){
+        log_msg("Prefetching %s failed.\n", entry->uri);
+        return -1;
+    }
+    if (resp->expires <= now)
+        resp->expires = now + entry->ttl;
+    if (cache_response(entry->key, vary_hdrs, resp, 1) < 0)
+        log_msg("No room to pin %s.\n", entry->uri);
     return 0;
 }
 
 
 void close_wrapper(int fd) {
     if (close(fd) < 0)
-        printf("Error closing file.\n");
+        log_msg("Error closing file.\n");
 }
-
@@ -0,0 +1,176 @@
+/*
+ * range.c - Byte range requests served from cached objects.
+ *
+ *     Ranges always refer to the identity body, so a gzip-encoded object is
+ *     inflated before the requested bytes are cut out of it.
+ *     One range gives a 206 with Content-Range, several give a
+ *     multipart/byteranges body, and none satisfiable gives a 416.
+ */
+#include "range.h"
+#include "gzip.h"
+
+static const char *boundary_fmt = "PROXY_BYTERANGES_%08lx";
+
+
+/*
+ * parse_range - Parse a Range header value ("bytes=0-99,200-,-50") against a
+ *               body of total bytes. Unsatisfiable ranges are skipped.
+ *               Returns the number of ranges stored in ranges (0 : none satisfiable),
+ *               or -1 if spec is not a byte range set we handle.
+ */
+int parse_range(char *spec, size_t total, byte_range *ranges, int max)
+{
+    char *p = spec, *end;
+    unsigned long long first, last;
+    int n = 0;
+
+    while (*p == ' ')
+        p++;
+    if (strncasecmp(p, "bytes=", 6))
+        return -1;
+    p += 6;
+
+    while (1){
+        while (*p == ' ')
+            p++;
+        if (*p == '-'){     /* suffix range : last N bytes */
+            last = strtoull(p + 1, &end, 10);
+            if (end == p + 1)
+                return -1;
+            first = (last < total) ? total - last : 0;
+            last = total - 1;
+            if (total == 0 || first > last)
+                first = total;  /* "-0" or empty body */
+        }
+        else {
+            first = strtoull(p, &end, 10);
+            if (end == p || *end != '-')
+                return -1;
+            p = end + 1;
+            last = strtoull(p, &end, 10);
+            if (end == p)
+                last = total - 1;   /* "N-" : to the end */
+            else if (last < first)
+                return -1;
+            if (last >= total)
+                last = total - 1;
+        }
+
+        if (first < total){
+            if (n == max)
+                return -1;
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+
+        for (p = end; *p == ' '; p++)
+            ;
+        if (*p == ',')
+            p++;
+        else if (*p == '\0' || *p == '\r' || *p == '\n')
+            return n;
+        else
+            return -1;
+    }
+}
+
+
+/*
+ * serve_range - Answer a Range request with the body of a cached object.
+ *               extra_hdrs are sent after the status line, and the status sent
+ *               (206 or 416) is stored in *status.
+ *               Returns 0 on success, -1 on write error, and 1 if spec was not
+ *               understood and the caller should send the whole object instead.
+ */
+int serve_range(int connfd, cache_obj *obj, char *spec, char *extra_hdrs, int *status)
+{
+    byte_range ranges[MAX_RANGES];
+    char hdr[2*MAXLINE], boundary[64], content_type[MAXLINE] = "";
+    char *body = obj->data + obj->hdr_size, *raw = NULL;
+    char *line, *end, *eol;
+    size_t total = obj->raw_size, len, clen;
+    int n, i, rc = -1;
+
+    if ((n = parse_range(spec, total, ranges, MAX_RANGES)) < 0)
+        return 1;
+    if ((line = memchr(obj->data, '\n', obj->hdr_size)) == NULL)
+        return 1;       /* no status line to replace */
+    line++;
+    end = obj->data + obj->hdr_size;
+
+    if (n == 0){
+        *status = 416;
+        sprintf(hdr, "HTTP/1.0 416 Range Not Satisfiable\r\n%sContent-Range: bytes */%zu\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n", extra_hdrs, total);
+        return (rio_writen(connfd, hdr, strlen(hdr)) < 0) ? -1 : 0;
+    }
+
+    if (obj->gzipped){
+        raw = Malloc(total);
+        if (gzip_decode(body, obj->size - obj->hdr_size, raw, total) != total){
+            Free(raw);
+            return 1;
+        }
+        body = raw;
+    }
+
+    /* Status line becomes 206, the other headers are kept (Content-Type moves into parts) */
+    *status = 206;
+    strcpy(hdr, "HTTP/1.0 206 Partial Content\r\n");
+    if (rio_writen(connfd, hdr, strlen(hdr)) < 0 || rio_writen(connfd, extra_hdrs, strlen(extra_hdrs)) < 0)
+        goto out;
+    for (; line < end; line += len){
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            break;
+        len = eol - line + 1;
+        if (n > 1 && !strncasecmp(line, "Content-Type:", 13) && len < MAXLINE){
+            memcpy(content_type, line, len);
+            content_type[len] = '\0';
+            continue;
+        }
+        if (rio_writen(connfd, line, len) < 0)
+            goto out;
+    }
+
+    if (n == 1){
+        sprintf(hdr, "Content-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                ranges[0].first, ranges[0].last, total, ranges[0].last - ranges[0].first + 1);
+        if (rio_writen(connfd, hdr, strlen(hdr)) < 0
+            || rio_writen(connfd, body + ranges[0].first, ranges[0].last - ranges[0].first + 1) < 0)
+            goto out;
+        rc = 0;
+        goto out;
+    }
+
+    /* multipart/byteranges : compute the length first since we send Content-Length */
+    sprintf(boundary, boundary_fmt, (unsigned long)time(NULL) ^ (unsigned long)obj);
+    clen = 0;
+    for (i = 0; i < n; i++){
+        sprintf(hdr, "\r\n--%s\r\n%sContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                boundary, content_type, ranges[i].first, ranges[i].last, total);
+        clen += strlen(hdr) + ranges[i].last - ranges[i].first + 1;
+    }
+    clen += strlen(boundary) + 8;   /* "\r\n--" boundary "--\r\n" */
+
+    sprintf(hdr, "Content-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", boundary, clen);
+    if (rio_writen(connfd, hdr, strlen(hdr)) < 0)
+        goto out;
+    for (i = 0; i < n; i++){
+        sprintf(hdr, "\r\n--%s\r\n%sContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                boundary, content_type, ranges[i].first, ranges[i].last, total);
+        if (rio_writen(connfd, hdr, strlen(hdr)) < 0
+            || rio_writen(connfd, body + ranges[i].first, ranges[i].last - ranges[i].first + 1) < 0)
+            goto out;
+    }
+    sprintf(hdr, "\r\n--%s--\r\n", boundary);
+    if (rio_writen(connfd, hdr, strlen(hdr)) < 0)
+        goto out;
+    rc = 0;
+
+ out:
+    if (raw != NULL)
+        Free(raw);
+    return rc;
+}
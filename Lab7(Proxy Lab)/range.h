@@ -0,0 +1,21 @@
+/*
+ * range.h - Byte range requests served from cached objects
+ */
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define MAX_RANGES 16       /* More ranges than this are answered with the whole object */
+
+/* Inclusive range of body bytes */
+typedef struct {
+    size_t first;
+    size_t last;
+} byte_range;
+
+int parse_range(char *spec, size_t total, byte_range *ranges, int max);
+int serve_range(int connfd, cache_obj *obj, char *spec, char *extra_hdrs, int *status);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,152 @@
+/*
+ * ratelimit.c - Per-client token buckets and connection admission control.
+ *
+ *     Every client address has a token bucket which refills at rate tokens per
+ *     second up to burst tokens, and each accepted connection takes one token.
+ *     Buckets live in a chained hash table whose chains are protected by
+ *     NSTRIPES mutexes, so clients hashing to different stripes never contend.
+ *     A bucket that has been idle long enough to be full again is the same as
+ *     no bucket, so such buckets are dropped while walking their chain.
+ *
+ *     Independently of the client, at most max_conns connections are served
+ *     at once.
+ */
+#include "ratelimit.h"
+
+#define NBUCKETS 4096       /* Hash chains */
+#define NSTRIPES 64         /* Mutexes; chain i is protected by lock i % NSTRIPES */
+
+typedef struct bucket {
+    unsigned char addr[16]; /* IPv4 or IPv6 address */
+    double tokens;
+    double last;            /* Time of last refill (secs) */
+    struct bucket *next;
+} bucket;
+
+static bucket *table[NBUCKETS];
+static pthread_mutex_t stripes[NSTRIPES];
+
+static double fill_rate = 0;    /* Tokens per second (0 : no rate limit) */
+static double capacity = 0;     /* Bucket size */
+static int conn_limit = 0;      /* Max concurrent connections (0 : no limit) */
+static int conn_count = 0;
+
+static double now_secs(void);
+static unsigned int hash_addr(unsigned char *addr);
+
+
+void ratelimit_init(double rate, double burst, int max_conns)
+{
+    int i;
+
+    fill_rate = rate;
+    capacity = (burst >= 1) ? burst : 1;
+    conn_limit = max_conns;
+    for (i = 0; i < NSTRIPES; i++)
+        pthread_mutex_init(&stripes[i], NULL);
+}
+
+
+/*
+ * ratelimit_allow - Take a token from the bucket of the client at addr.
+ *                   Returns 1 if the client may go on, 0 if it is over its rate.
+ */
+int ratelimit_allow(struct sockaddr *addr)
+{
+    unsigned char key[16];
+    unsigned int h;
+    bucket **pp, *b, *found = NULL;
+    double now, idle = capacity / fill_rate;
+    int allow;
+
+    if (fill_rate <= 0)
+        return 1;
+
+    memset(key, 0, sizeof(key));
+    if (addr->sa_family == AF_INET6)
+        memcpy(key, &((struct sockaddr_in6 *)addr)->sin6_addr, 16);
+    else
+        memcpy(key, &((struct sockaddr_in *)addr)->sin_addr, 4);
+    h = hash_addr(key) % NBUCKETS;
+    now = now_secs();
+
+    pthread_mutex_lock(&stripes[h % NSTRIPES]);
+    for (pp = &table[h]; (b = *pp) != NULL; ){
+        if (!memcmp(b->addr, key, 16)){
+            found = b;
+            pp = &b->next;
+        }
+        else if (now - b->last >= idle){    /* full again : drop it */
+            *pp = b->next;
+            Free(b);
+        }
+        else
+            pp = &b->next;
+    }
+    if (found == NULL){
+        found = Malloc(sizeof(bucket));
+        memcpy(found->addr, key, 16);
+        found->tokens = capacity;
+        found->last = now;
+        found->next = table[h];
+        table[h] = found;
+    }
+
+    found->tokens += (now - found->last) * fill_rate;
+    if (found->tokens > capacity)
+        found->tokens = capacity;
+    found->last = now;
+    if ((allow = (found->tokens >= 1)))
+        found->tokens -= 1;
+    pthread_mutex_unlock(&stripes[h % NSTRIPES]);
+    return allow;
+}
+
+
+/*
+ * conn_admit - Count a new connection. Returns 0 (and does not count it)
+ *              if max_conns connections are already being served.
+ */
+int conn_admit(void)
+{
+    if (__atomic_add_fetch(&conn_count, 1, __ATOMIC_ACQ_REL) > conn_limit && conn_limit > 0){
+        __atomic_sub_fetch(&conn_count, 1, __ATOMIC_ACQ_REL);
+        return 0;
+    }
+    return 1;
+}
+
+
+void conn_done(void)
+{
+    __atomic_sub_fetch(&conn_count, 1, __ATOMIC_ACQ_REL);
+}
+
+
+int conn_active(void)
+{
+    return __atomic_load_n(&conn_count, __ATOMIC_ACQUIRE);
+}
+
+
+static double now_secs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* FNV-1a */
+static unsigned int hash_addr(unsigned char *addr)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i = 0; i < 16; i++){
+        h ^= addr[i];
+        h *= 16777619u;
+    }
+    return h;
+}
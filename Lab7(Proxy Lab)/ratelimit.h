@@ -0,0 +1,15 @@
+/*
+ * ratelimit.h - Per-client token buckets and connection admission control
+ */
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include "csapp.h"
+
+void ratelimit_init(double rate, double burst, int max_conns);
+int ratelimit_allow(struct sockaddr *addr);
+int conn_admit(void);
+void conn_done(void);
+int conn_active(void);
+
+#endif /* __RATELIMIT_H__ */
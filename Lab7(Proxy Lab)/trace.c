@@ -0,0 +1,127 @@
+/*
+ * trace.c - Per-request phase tracing in Chrome trace format.
+ *
+ *     Every request carries a trace_t. trace_mark() takes a CLOCK_MONOTONIC
+ *     timestamp where a phase starts (queue, read request, dns, connect,
+ *     origin wait, relay, ...), which costs a vDSO call and no lock.
+ *
+ *     When the request is done, trace_finish() decides whether to write it:
+ *     a request slower than the slow threshold always is, the others are
+ *     sampled evenly by request number. A written request is one complete
+ *     ("X") event for the whole request and one per phase, each on its own
+ *     line of the trace file (-t) through the log writer thread.
+ *
+ *     The file is a JSON array without the closing bracket, which the
+ *     Chrome trace viewer (chrome://tracing, Perfetto) accepts, so events
+ *     can be appended while the proxy runs. Each request has its own row.
+ */
+#include "trace.h"
+#include "log.h"
+
+static int tracing = 0;
+static double sample_rate = TRACE_SAMPLE;
+static long slow_us = TRACE_SLOW_MS * 1000L;
+static unsigned long next_id = 0;
+
+static void json_escape(char *dst, size_t size, char *src);
+
+
+/*
+ * trace_init - Start tracing requests. A sample fraction of them is written,
+ *              and every request which takes slow_ms or longer.
+ */
+void trace_init(double sample, long slow_ms)
+{
+    sample_rate = sample;
+    slow_us = slow_ms * 1000;
+    tracing = 1;
+}
+
+
+/*
+ * trace_now - Current time in usecs on CLOCK_MONOTONIC
+ */
+long trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * trace_start - Start the trace of a request whose connection was accepted
+ *               at accepted; the first phase is the wait for a thread.
+ */
+void trace_start(trace_t *t, long accepted)
+{
+    t->n = 0;
+    if (!tracing)
+        return;
+    t->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    t->name[0] = "queue";
+    t->start[0] = accepted;
+    t->n = 1;
+}
+
+
+/*
+ * trace_mark - End the current phase and start phase
+ */
+void trace_mark(trace_t *t, const char *phase)
+{
+    if (t == NULL || t->n == 0 || t->n == TRACE_MAX_PHASES)
+        return;
+    t->name[t->n] = phase;
+    t->start[t->n] = trace_now();
+    t->n++;
+}
+
+
+/*
+ * trace_finish - End the last phase and write the trace if the request
+ *                was slow or is sampled
+ */
+void trace_finish(trace_t *t, char *method, char *uri, int status, char *result)
+{
+    long end, total;
+    char esc[256], name[64];
+    int i, pid = getpid();
+
+    if (t->n == 0)
+        return;
+    end = trace_now();
+    total = end - t->start[0];
+    /* the sample of each request number falls in a different unit interval */
+    if (total < slow_us && (unsigned long)((t->id + 1) * sample_rate) == (unsigned long)(t->id * sample_rate))
+        return;
+
+    json_escape(esc, sizeof(esc), uri);
+    json_escape(name, sizeof(name), method[0] ? method : "-");
+    log_trace("{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%lu,"
+              "\"args\":{\"uri\":\"%s\",\"status\":%d,\"result\":\"%s\",\"slow\":%d}},\n",
+              name, t->start[0], total, pid, t->id, esc, status, result, total >= slow_us);
+    for (i = 0; i < t->n; i++)
+        log_trace("{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%lu},\n",
+                  t->name[i], t->start[i], ((i + 1 < t->n) ? t->start[i + 1] : end) - t->start[i], pid, t->id);
+}
+
+
+/*
+ * json_escape - Copy src to dst as the contents of a JSON string, cut to fit in size bytes
+ */
+static void json_escape(char *dst, size_t size, char *src)
+{
+    size_t len = 0;
+
+    for (; *src && len + 7 < size; src++){
+        if (*src == '"' || *src == '\\')
+            dst[len++] = '\\';
+        if ((unsigned char)*src < 0x20)
+            len += sprintf(dst + len, "\\u%04x", *src);
+        else
+            dst[len++] = *src;
+    }
+    dst[len] = '\0';
+}
@@ -0,0 +1,27 @@
+/*
+ * trace.h - Per-request phase tracing in Chrome trace format
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "csapp.h"
+
+#define TRACE_MAX_PHASES 16     /* Later phases of a request are not recorded */
+#define TRACE_SAMPLE 0.01       /* Default fraction of requests traced (-s) */
+#define TRACE_SLOW_MS 1000      /* Default threshold of slow requests, always traced (-w) */
+
+/* Phases of one request; each phase ends where the next one starts */
+typedef struct {
+    unsigned long id;           /* Request number */
+    int n;
+    const char *name[TRACE_MAX_PHASES];
+    long start[TRACE_MAX_PHASES];   /* usecs on CLOCK_MONOTONIC */
+} trace_t;
+
+void trace_init(double sample, long slow_ms);
+long trace_now(void);
+void trace_start(trace_t *t, long accepted);
+void trace_mark(trace_t *t, const char *phase);
+void trace_finish(trace_t *t, char *method, char *uri, int status, char *result);
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,156 @@
+/*
+ * tunnel.c - Bidirectional relay for CONNECT tunnels.
+ *
+ *     One thread relays both directions of a tunnel. Bytes move from one
+ *     socket to the other through a pipe with splice(), so they are never
+ *     copied to user space. Both sockets are non-blocking and poll() tells
+ *     which direction can make progress.
+ *
+ *     When one side closes, what is left in its pipe is written out and the
+ *     other side's write half is shut down. The tunnel ends when both
+ *     directions are done, on error, or after TUNNEL_IDLE_TIMEOUT.
+ */
+/* splice() is Linux-specific; csapp.h is not included since it clashes with _GNU_SOURCE */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "tunnel.h"
+
+/* One direction of a tunnel */
+typedef struct {
+    int from;
+    int to;
+    int pipefd[2];
+    size_t pending;         /* Bytes in the pipe */
+    size_t capacity;        /* Size of the pipe */
+    int eof;                /* from has been closed */
+    int done;               /* eof and pipe is drained */
+} direction;
+
+static int dir_init(direction *d, int from, int to);
+static void dir_close(direction *d);
+static int dir_step(direction *d, short from_revents, short to_revents);
+
+
+/*
+ * tunnel_relay - Relay bytes between connfd and serverfd until both sides close.
+ *                Returns 0 on a clean close, -1 on error or timeout.
+ */
+int tunnel_relay(int connfd, int serverfd)
+{
+    direction up, down;     /* client -> server, server -> client */
+    struct pollfd fds[2];
+    int n, rc = -1;
+
+    if (dir_init(&up, connfd, serverfd) < 0)
+        return -1;
+    if (dir_init(&down, serverfd, connfd) < 0){
+        dir_close(&up);
+        return -1;
+    }
+    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+    fcntl(serverfd, F_SETFL, fcntl(serverfd, F_GETFL) | O_NONBLOCK);
+
+    fds[0].fd = connfd;
+    fds[1].fd = serverfd;
+    while (!up.done || !down.done){
+        fds[0].events = fds[1].events = 0;
+        if (!up.eof && up.pending < up.capacity)
+            fds[0].events |= POLLIN;
+        if (!down.eof && down.pending < down.capacity)
+            fds[1].events |= POLLIN;
+        if (up.pending > 0)
+            fds[1].events |= POLLOUT;
+        if (down.pending > 0)
+            fds[0].events |= POLLOUT;
+
+        if ((n = poll(fds, 2, TUNNEL_IDLE_TIMEOUT * 1000)) < 0){
+            if (errno == EINTR)
+                continue;
+            goto out;
+        }
+        if (n == 0)     /* idle */
+            goto out;
+
+        if (dir_step(&up, fds[0].revents, fds[1].revents) < 0
+            || dir_step(&down, fds[1].revents, fds[0].revents) < 0)
+            goto out;
+
+        /* A side which hung up can not take more bytes once its own direction is done */
+        if ((fds[0].revents & (POLLHUP | POLLERR)) && up.done)
+            break;
+        if ((fds[1].revents & (POLLHUP | POLLERR)) && down.done)
+            break;
+    }
+    rc = 0;
+
+ out:
+    dir_close(&up);
+    dir_close(&down);
+    return rc;
+}
+
+
+static int dir_init(direction *d, int from, int to)
+{
+    int size;
+
+    if (pipe(d->pipefd) < 0)
+        return -1;
+    d->from = from;
+    d->to = to;
+    d->pending = 0;
+    d->capacity = ((size = fcntl(d->pipefd[1], F_GETPIPE_SZ)) > 0) ? size : 65536;
+    d->eof = 0;
+    d->done = 0;
+    return 0;
+}
+
+
+static void dir_close(direction *d)
+{
+    close(d->pipefd[0]);
+    close(d->pipefd[1]);
+}
+
+
+/*
+ * dir_step - Move bytes from d->from into the pipe and from the pipe to d->to,
+ *            as far as the sockets allow without blocking.
+ */
+static int dir_step(direction *d, short from_revents, short to_revents)
+{
+    ssize_t n;
+
+    /* With the pipe full, splice() of 0 bytes would return 0 and look like EOF */
+    if (!d->eof && d->pending < d->capacity && (from_revents & (POLLIN | POLLHUP | POLLERR))){
+        n = splice(d->from, NULL, d->pipefd[1], NULL, d->capacity - d->pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+            d->eof = 1;
+        else if (n > 0)
+            d->pending += n;
+        else if (errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+
+    /* Write right away; poll() is only needed when the socket buffer is full */
+    if (d->pending > 0){
+        n = splice(d->pipefd[0], NULL, d->to, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+            d->pending -= n;
+        else if (n < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+        else if (to_revents & (POLLHUP | POLLERR))
+            return -1;
+    }
+
+    if (d->eof && d->pending == 0 && !d->done){
+        shutdown(d->to, SHUT_WR);
+        d->done = 1;
+    }
+    return 0;
+}
@@ -0,0 +1,11 @@
+/*
+ * tunnel.h - CONNECT tunnels
+ */
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#define TUNNEL_IDLE_TIMEOUT 300     /* Close a tunnel with no traffic for this long (secs) */
+
+int tunnel_relay(int connfd, int serverfd);
+
+#endif /* __TUNNEL_H__ */
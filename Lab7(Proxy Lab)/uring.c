@@ -0,0 +1,454 @@
+/*
+ * uring.c - Optional io_uring I/O backend.
+ *
+ *     The rings are driven with the raw io_uring_setup/enter/register system
+ *     calls, so liburing is not needed. Two parts of the proxy use them:
+ *
+ *     uring_accept_loop - URING_ACCEPT_BATCH accepts are kept queued on the
+ *         listening socket. One io_uring_enter() both re-arms the accepts
+ *         that completed and waits, and every completion found is handled
+ *         before entering the kernel again.
+ *
+ *     uring_relay - Copies a response body from the origin to the client
+ *         through two registered buffers. The write of one chunk and the read
+ *         of the next one go to the kernel in a single io_uring_enter(), so a
+ *         chunk costs one system call instead of a read() and a write().
+ *         Relay rings are kept in a pool since proxy threads are short lived.
+ *
+ *     Built without <linux/io_uring.h>, or when the kernel refuses
+ *     io_uring_setup(), every function reports that io_uring is unavailable
+ *     and the proxy keeps using read()/write() through the Rio package.
+ */
+#include "uring.h"
+#include "log.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/* user_data of relay requests */
+#define RELAY_READ 1
+#define RELAY_WRITE 2
+#define RING_CANCEL (~0ULL)     /* user_data of cancel requests */
+
+typedef struct uring_t {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned to_submit;         /* Queued but not yet submitted */
+    unsigned pending;           /* Submitted but not yet reaped */
+    int intr;                   /* ring_enter() returns when a signal arrives */
+    char *bufs;                 /* Registered relay buffers */
+    struct uring_t *next;       /* Next ring in the pool */
+} uring_t;
+
+static int enabled = 0;
+static uring_t *pool = NULL;
+static int pool_count = 0;      /* Relay rings in existence */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ring_setup(uring_t *r, unsigned entries);
+static void ring_teardown(uring_t *r);
+static int ring_queue(uring_t *r, int op, int fd, void *addr, unsigned len,
+                      unsigned long long off, int buf_index, unsigned long long user_data);
+static int ring_enter(uring_t *r, unsigned wait_nr);
+static int ring_reap(uring_t *r, struct io_uring_cqe *cqe);
+static int ring_wait(uring_t *r, struct io_uring_cqe *cqe);
+static int ring_drain(uring_t *r, unsigned long long first, int n, int close_fds);
+static uring_t *ring_get(void);
+static void ring_put(uring_t *r);
+static void ring_drop(uring_t *r);
+
+
+/*
+ * uring_init - Check that io_uring works here and enable it.
+ *              Returns 0 if it is enabled, -1 if the proxy has to use read()/write().
+ */
+int uring_init(void)
+{
+    uring_t *r;
+
+    enabled = 1;
+    if ((r = ring_get()) == NULL){
+        enabled = 0;
+        return -1;
+    }
+    ring_put(r);
+    return 0;
+}
+
+
+/*
+ * uring_accept_loop - Accept connections on listenfd and pass them to handler.
+ *                     Returns 0 when a signal arrives with *stop set,
+ *                     or -1 if io_uring can not be used.
+ */
+int uring_accept_loop(int listenfd, accept_fn handler, volatile sig_atomic_t *stop)
+{
+    uring_t r;
+    struct io_uring_cqe cqe;
+    struct sockaddr_storage addrs[URING_ACCEPT_BATCH];
+    socklen_t lens[URING_ACCEPT_BATCH];
+    int i;
+
+    if (!enabled || ring_setup(&r, URING_ACCEPT_BATCH) < 0)
+        return -1;
+    r.intr = 1;
+    for (i = 0; i < URING_ACCEPT_BATCH; i++){
+        lens[i] = sizeof(addrs[i]);
+        ring_queue(&r, IORING_OP_ACCEPT, listenfd, &addrs[i], 0, (unsigned long)&lens[i], 0, i);
+    }
+
+    while (!*stop){
+        if (ring_enter(&r, 1) < 0 && errno != EINTR){
+            r.intr = 0;
+            ring_drain(&r, 0, URING_ACCEPT_BATCH, 1);
+            ring_teardown(&r);
+            return -1;
+        }
+        while (ring_reap(&r, &cqe)){
+            i = cqe.user_data;
+            if (cqe.res >= 0)
+                handler(cqe.res, (struct sockaddr *)&addrs[i]);
+            else
+                log_msg("Accept failed.\n");
+            lens[i] = sizeof(addrs[i]);
+            if (!*stop)
+                ring_queue(&r, IORING_OP_ACCEPT, listenfd, &addrs[i], 0, (unsigned long)&lens[i], 0, i);
+        }
+    }
+
+    /* Connections accepted after the stop are closed, the successor accepts them again */
+    r.intr = 0;
+    ring_drain(&r, 0, URING_ACCEPT_BATCH, 1);
+    ring_teardown(&r);
+    return 0;
+}
+
+
+/*
+ * uring_relay - Copy bytes from from to to until EOF on from.
+ *               fn sees every chunk before it is written.
+ *               Returns the number of bytes relayed, -1 on error,
+ *               or -2 if io_uring is not available (nothing was read).
+ */
+ssize_t uring_relay(int from, int to, relay_fn fn, void *arg)
+{
+    uring_t *r;
+    struct io_uring_cqe cqe;
+    char *buf[2];
+    ssize_t total = 0, nread, next = 0, nwritten = 0;
+    int cur = 0, i;
+
+    if (!enabled || (r = ring_get()) == NULL)
+        return -2;
+    buf[0] = r->bufs;
+    buf[1] = r->bufs + URING_RELAY_BUFSIZE;
+
+    ring_queue(r, IORING_OP_READ_FIXED, from, buf[0], URING_RELAY_BUFSIZE, 0, 0, RELAY_READ);
+    if (ring_enter(r, 1) < 0 || ring_wait(r, &cqe) < 0){
+        ring_drop(r);
+        return -1;
+    }
+    nread = cqe.res;
+
+    while (nread > 0){
+        if (fn(buf[cur], nread, arg) < 0)
+            break;
+
+        /* Write this chunk and read the next one into the other buffer */
+        ring_queue(r, IORING_OP_WRITE_FIXED, to, buf[cur], nread, 0, cur, RELAY_WRITE);
+        ring_queue(r, IORING_OP_READ_FIXED, from, buf[cur ^ 1], URING_RELAY_BUFSIZE, 0, cur ^ 1, RELAY_READ);
+        if (ring_enter(r, 2) < 0){
+            ring_drop(r);
+            return -1;
+        }
+        for (i = 0; i < 2; i++){
+            if (ring_wait(r, &cqe) < 0){
+                ring_drop(r);
+                return -1;
+            }
+            if (cqe.user_data == RELAY_WRITE)
+                nwritten = cqe.res;
+            else
+                next = cqe.res;
+        }
+
+        /* Short write : finish it the ordinary way */
+        if (nwritten >= 0 && nwritten < nread)
+            nwritten = (rio_writen(to, buf[cur] + nwritten, nread - nwritten) < 0) ? -1 : nread;
+        if (nwritten < 0){
+            nread = -1;
+            break;
+        }
+        total += nread;
+        nread = next;
+        cur ^= 1;
+    }
+
+    ring_put(r);
+    return (nread < 0) ? -1 : total;
+}
+
+
+static int ring_setup(uring_t *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = 0;      /* shares the SQ mapping */
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto err;
+    r->cq_ptr = r->sq_ptr;
+    if (r->cq_len > 0){
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto err;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto err;
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+    r->entries = p.sq_entries;
+    return 0;
+
+ err:
+    ring_teardown(r);
+    return -1;
+}
+
+
+static void ring_teardown(uring_t *r)
+{
+    if (r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_len > 0 && r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+
+/*
+ * ring_queue - Fill the next submission queue entry. It is submitted by the next ring_enter().
+ */
+static int ring_queue(uring_t *r, int op, int fd, void *addr, unsigned len,
+                      unsigned long long off, int buf_index, unsigned long long user_data)
+{
+    unsigned tail = *r->sq_tail, idx;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries)
+        return -1;
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->off = off;             /* addr2 (addrlen) for accept */
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return 0;
+}
+
+
+/*
+ * ring_enter - Submit queued entries and wait until wait_nr completions are available
+ */
+static int ring_enter(uring_t *r, unsigned wait_nr)
+{
+    int n;
+
+    do {
+        n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr,
+                    wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (n < 0 && errno == EINTR && !r->intr);
+    if (n < 0)
+        return -1;
+    r->to_submit -= n;
+    r->pending += n;
+    return n;
+}
+
+
+/*
+ * ring_reap - Take one completion if there is one. Returns 1 if cqe was filled.
+ */
+static int ring_reap(uring_t *r, struct io_uring_cqe *cqe)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    r->pending--;
+    return 1;
+}
+
+
+static int ring_wait(uring_t *r, struct io_uring_cqe *cqe)
+{
+    while (!ring_reap(r, cqe))
+        if (ring_enter(r, 1) < 0)
+            return -1;
+    return 0;
+}
+
+
+/*
+ * ring_drain - Cancel the requests with user_data first .. first+n-1 and reap
+ *              every completion, so nothing in flight is left on the ring.
+ *              With close_fds, completions are accepts and their fds are closed.
+ *              Returns -1 if the ring fails before it is empty.
+ */
+static int ring_drain(uring_t *r, unsigned long long first, int n, int close_fds)
+{
+    struct io_uring_cqe cqe;
+    int i;
+
+    for (i = 0; i < n; i++){
+        while (ring_queue(r, IORING_OP_ASYNC_CANCEL, -1, (void *)(unsigned long)(first + i), 0, 0, 0,
+                          RING_CANCEL) < 0)
+            if (ring_enter(r, 0) < 0)
+                return -1;
+    }
+    while (r->pending > 0 || r->to_submit > 0){
+        if (ring_enter(r, r->pending > 0) < 0)
+            return -1;
+        while (ring_reap(r, &cqe))
+            if (close_fds && cqe.user_data != RING_CANCEL && cqe.res >= 0)
+                close(cqe.res);
+    }
+    return 0;
+}
+
+
+/*
+ * ring_get - Take a relay ring from the pool, making a new one if the pool is empty.
+ *            Returns NULL if URING_POOL_MAX rings are in use or io_uring fails.
+ */
+static uring_t *ring_get(void)
+{
+    uring_t *r;
+    struct iovec iov[2];
+
+    pthread_mutex_lock(&pool_lock);
+    if ((r = pool) != NULL){
+        pool = r->next;
+        pthread_mutex_unlock(&pool_lock);
+        return r;
+    }
+    if (pool_count >= URING_POOL_MAX){
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+    pool_count++;
+    pthread_mutex_unlock(&pool_lock);
+
+    r = Malloc(sizeof(uring_t));
+    if (ring_setup(r, 4) < 0){
+        Free(r);
+        pthread_mutex_lock(&pool_lock);
+        pool_count--;
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+    r->bufs = Malloc(2 * URING_RELAY_BUFSIZE);
+    iov[0].iov_base = r->bufs;
+    iov[0].iov_len = URING_RELAY_BUFSIZE;
+    iov[1].iov_base = r->bufs + URING_RELAY_BUFSIZE;
+    iov[1].iov_len = URING_RELAY_BUFSIZE;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, 2) < 0){
+        Free(r->bufs);
+        r->bufs = NULL;
+        ring_drop(r);
+        return NULL;
+    }
+    return r;
+}
+
+
+static void ring_put(uring_t *r)
+{
+    pthread_mutex_lock(&pool_lock);
+    r->next = pool;
+    pool = r;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+/*
+ * ring_drop - Destroy a relay ring after an error.
+ *             Requests still in flight are cancelled first, since they may write into
+ *             the buffers. Only if the ring fails meanwhile are the buffers left allocated.
+ */
+static void ring_drop(uring_t *r)
+{
+    if (ring_drain(r, RELAY_READ, 2, 0) == 0){
+        syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        Free(r->bufs);
+    }
+    else
+        log_msg("io_uring relay ring failed with requests in flight.\n");
+    ring_teardown(r);
+    Free(r);
+    pthread_mutex_lock(&pool_lock);
+    pool_count--;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+#else /* !HAVE_IO_URING */
+
+int uring_init(void)
+{
+    return -1;
+}
+
+int uring_accept_loop(int listenfd, accept_fn handler, volatile sig_atomic_t *stop)
+{
+    return -1;
+}
+
+ssize_t uring_relay(int from, int to, relay_fn fn, void *arg)
+{
+    return -2;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,23 @@
+/*
+ * uring.h - Optional io_uring I/O backend (raw system calls, no liburing)
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "csapp.h"
+
+#define URING_ACCEPT_BATCH 32       /* Accepts kept queued in the accept ring */
+#define URING_RELAY_BUFSIZE 65536   /* Size of each registered relay buffer */
+#define URING_POOL_MAX 64           /* Relay rings kept for reuse */
+
+/* Called by uring_accept_loop() for every accepted connection */
+typedef void (*accept_fn)(int connfd, struct sockaddr *addr);
+
+/* Called by uring_relay() with every chunk it reads; returns < 0 to stop */
+typedef int (*relay_fn)(char *buf, size_t n, void *arg);
+
+int uring_init(void);
+int uring_accept_loop(int listenfd, accept_fn handler, volatile sig_atomic_t *stop);
+ssize_t uring_relay(int from, int to, relay_fn fn, void *arg);
+
+#endif /* __URING_H__ */